@@ -0,0 +1,467 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>  // For writev
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <errno.h>
+#include <limits.h>  // For PATH_MAX
+#include <fcntl.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+
+// Load generator for serverw24.
+//   benchw24 -g <dir> [-n files] [-d depth] [-w width] [-s min:max]   builds a synthetic home tree
+//   benchw24 [-H host] [-p port] [-c conns] [-t seconds] [-m mix] [-n files]  drives a running server
+// Results are printed to stdout as one JSON object; progress and errors go to stderr.
+
+#define BUFFER_SIZE 1024
+#define DEFAULT_PORT 2024
+#define DEFAULT_FILES 10000
+#define DEFAULT_DEPTH 3
+#define DEFAULT_WIDTH 8
+#define DEFAULT_MIX "dirlist=2,w24fn=4,w24fz=2,w24ft=1,w24fdb=1,w24fda=1"
+#define DATE_SPAN_DAYS 365  // Generated mtimes fall within this many days before now
+
+// Wire protocol, as in Server/serverw24.c
+#define FRAME_MAGIC 0x5734
+#define FRAME_VERSION 1
+#define OP_REQUEST 0x01
+#define OP_ERROR 0x82
+#define FLAG_END 0x0001
+
+typedef struct {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint16_t reserved;
+    uint32_t id;
+    uint32_t length;
+} FrameHeader;
+
+static const char *extensions[] = { "c", "h", "txt", "pdf", "log", "md" };
+#define EXTENSION_COUNT (sizeof(extensions) / sizeof(extensions[0]))
+
+// Latency histogram with a bounded relative error, after HdrHistogram: values below
+// HIST_SUB are exact, above that each power of two is split into HIST_SUB linear buckets,
+// so a reported quantile is within 1/HIST_SUB of the true value
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total, max;
+} Histogram;
+
+static int histBucket(uint64_t v) {
+    if (v < HIST_SUB) return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+}
+
+// Highest value that lands in bucket b
+static uint64_t histBucketTop(int b) {
+    if (b < HIST_SUB) return b;
+    int shift = b / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+}
+
+static void histRecord(Histogram *h, uint64_t v) {
+    h->counts[histBucket(v)]++;
+    h->total++;
+    if (v > h->max) h->max = v;
+}
+
+static void histMerge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->max > into->max) into->max = from->max;
+}
+
+static uint64_t histQuantile(const Histogram *h, double q) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)ceil(q * h->total), seen = 0;
+    if (rank == 0) rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) return histBucketTop(i) < h->max ? histBucketTop(i) : h->max;
+    }
+    return h->max;
+}
+
+// One command family of the mix
+typedef enum { CMD_DIRLIST, CMD_W24FN, CMD_W24FZ, CMD_W24FT, CMD_W24FDB, CMD_W24FDA, CMD_COUNT } CommandKind;
+static const char *commandNames[CMD_COUNT] = { "dirlist", "w24fn", "w24fz", "w24ft", "w24fdb", "w24fda" };
+
+typedef struct {
+    Histogram latency;      // Microseconds
+    uint64_t errors;        // ERROR replies and failed connections
+    uint64_t bytes;         // Reply payload bytes
+} CommandStats;
+
+typedef struct {
+    unsigned seed;
+    CommandStats stats[CMD_COUNT];
+} Worker;
+
+static struct {
+    const char *host;
+    int port;
+    int conns;
+    int seconds;
+    int files;
+    int weights[CMD_COUNT];
+    int weightTotal;
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+    struct timespec deadline;
+} bench;
+
+void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static uint64_t nowMicros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Path of the directory that holds file i: the index spread over depth levels of width children
+static void generatedDir(const char *root, int i, int depth, int width, char *buf, size_t len) {
+    int n = snprintf(buf, len, "%s", root);
+    int node = i;
+    for (int level = 0; level < depth && n < (int)len; level++) {
+        n += snprintf(buf + n, len - n, "/d%d", node % width);
+        node /= width;
+    }
+}
+
+// Sizes are log-uniform between min and max, so most files are small and a few are large
+static long generatedSize(unsigned *seed, long min, long max) {
+    double lo = log((double)(min > 0 ? min : 1)), hi = log((double)max);
+    double r = (double)rand_r(seed) / RAND_MAX;
+    long size = (long)exp(lo + (hi - lo) * r);
+    return size < min ? min : size;
+}
+
+static int makeDirs(char *path) {
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    return mkdir(path, 0755) < 0 && errno != EEXIST ? -1 : 0;
+}
+
+// Writes files f0..f<count-1> with the extensions in turn; the run mode asks for the same names
+static void generateTree(const char *root, int count, int depth, int width, long minSize, long maxSize) {
+    char dir[PATH_MAX], path[PATH_MAX + 32];
+    static char block[64 * 1024];
+    unsigned seed = 2024;
+    time_t now = time(NULL);
+    for (size_t i = 0; i < sizeof(block); i++) block[i] = 'a' + i % 26;
+
+    for (int i = 0; i < count; i++) {
+        generatedDir(root, i, depth, width, dir, sizeof(dir));
+        if (makeDirs(dir) < 0) error("ERROR creating directory");
+        snprintf(path, sizeof(path), "%s/f%d.%s", dir, i, extensions[i % EXTENSION_COUNT]);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) error("ERROR creating file");
+        long left = generatedSize(&seed, minSize, maxSize);
+        while (left > 0) {
+            ssize_t n = write(fd, block, left < (long)sizeof(block) ? left : (long)sizeof(block));
+            if (n < 0) error("ERROR writing file");
+            left -= n;
+        }
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = now - (time_t)(rand_r(&seed) % (DATE_SPAN_DAYS * 86400));
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        futimens(fd, times);
+        close(fd);
+        if ((i + 1) % 10000 == 0) fprintf(stderr, "Generated %d files\n", i + 1);
+    }
+    fprintf(stderr, "Generated %d files under %s\n", count, root);
+}
+
+// Parses "dirlist=2,w24fn=4,..." into bench.weights
+static int parseMix(const char *mix) {
+    char *copy = strdup(mix), *save, *tok;
+    memset(bench.weights, 0, sizeof(bench.weights));
+    bench.weightTotal = 0;
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        int kind = -1;
+        if (eq) *eq = '\0';
+        for (int k = 0; k < CMD_COUNT; k++)
+            if (strcmp(tok, commandNames[k]) == 0) kind = k;
+        if (kind < 0 || (eq && atoi(eq + 1) < 0)) {
+            free(copy);
+            return -1;
+        }
+        bench.weights[kind] = eq ? atoi(eq + 1) : 1;
+        bench.weightTotal += bench.weights[kind];
+    }
+    free(copy);
+    return bench.weightTotal > 0 ? 0 : -1;
+}
+
+static CommandKind pickCommand(unsigned *seed) {
+    int r = rand_r(seed) % bench.weightTotal;
+    for (int k = 0; k < CMD_COUNT; k++) {
+        if (r < bench.weights[k]) return k;
+        r -= bench.weights[k];
+    }
+    return CMD_DIRLIST;
+}
+
+// Builds a random instance of the command kind; w24fn names follow generateTree
+static void buildCommand(CommandKind kind, unsigned *seed, char *buf, size_t len) {
+    time_t when = time(NULL) - (time_t)(rand_r(seed) % (DATE_SPAN_DAYS * 86400));
+    struct tm tm;
+    char date[16];
+    strftime(date, sizeof(date), "%Y-%m-%d", localtime_r(&when, &tm));
+    switch (kind) {
+    case CMD_DIRLIST:
+        snprintf(buf, len, rand_r(seed) % 2 ? "dirlist -a" : "dirlist -t");
+        break;
+    case CMD_W24FN: {
+        int i = rand_r(seed) % bench.files;
+        snprintf(buf, len, "w24fn f%d.%s", i, extensions[i % EXTENSION_COUNT]);
+        break;
+    }
+    case CMD_W24FZ: {
+        long lo = 1L << (rand_r(seed) % 16);
+        snprintf(buf, len, "w24fz %ld %ld", lo, lo * 2);
+        break;
+    }
+    case CMD_W24FT:
+        snprintf(buf, len, "w24ft %s", extensions[rand_r(seed) % EXTENSION_COUNT]);
+        break;
+    case CMD_W24FDB:
+        snprintf(buf, len, "w24fdb %s", date);
+        break;
+    default:
+        snprintf(buf, len, "w24fda %s", date);
+        break;
+    }
+}
+
+static int readFull(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int connectServer(void) {
+    int fd = socket(bench.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (fd < 0) return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&bench.addr, bench.addrLen) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends one command and reads every frame up to END. Returns the payload bytes received,
+// or -1 if the connection failed; *failed is set for an ERROR reply.
+static long long roundTrip(int fd, uint32_t id, const char *cmd, int *failed) {
+    char scratch[64 * 1024];
+    FrameHeader header = {
+        .magic = htons(FRAME_MAGIC), .version = FRAME_VERSION, .opcode = OP_REQUEST,
+        .id = htonl(id), .length = htonl(strlen(cmd)),
+    };
+    struct iovec iov[2] = { { &header, sizeof(header) }, { (void *)cmd, strlen(cmd) } };
+    if (writev(fd, iov, 2) != (ssize_t)(sizeof(header) + strlen(cmd))) return -1;
+
+    long long bytes = 0;
+    *failed = 0;
+    while (1) {
+        if (readFull(fd, &header, sizeof(header)) < 0) return -1;
+        uint32_t left = ntohl(header.length);
+        if (ntohs(header.magic) != FRAME_MAGIC || ntohl(header.id) != id) return -1;
+        if (header.opcode == OP_ERROR) *failed = 1;
+        bytes += left;
+        while (left > 0) {
+            size_t want = left < sizeof(scratch) ? left : sizeof(scratch);
+            if (readFull(fd, scratch, want) < 0) return -1;
+            left -= want;
+        }
+        if (ntohs(header.flags) & FLAG_END) return bytes;
+    }
+}
+
+static int pastDeadline(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > bench.deadline.tv_sec ||
+           (now.tv_sec == bench.deadline.tv_sec && now.tv_nsec >= bench.deadline.tv_nsec);
+}
+
+// One connection: closed-loop request/response until the deadline, reconnecting after failures
+static void *workerMain(void *arg) {
+    Worker *w = arg;
+    char cmd[BUFFER_SIZE];
+    uint32_t id = 1;
+    int fd = connectServer();
+    while (!pastDeadline()) {
+        CommandKind kind = pickCommand(&w->seed);
+        buildCommand(kind, &w->seed, cmd, sizeof(cmd));
+        if (fd < 0 && (fd = connectServer()) < 0) {
+            w->stats[kind].errors++;
+            usleep(100000);
+            continue;
+        }
+        int failed;
+        uint64_t start = nowMicros();
+        long long bytes = roundTrip(fd, id++, cmd, &failed);
+        uint64_t elapsed = nowMicros() - start;
+        if (bytes < 0) {
+            w->stats[kind].errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        histRecord(&w->stats[kind].latency, elapsed);
+        w->stats[kind].bytes += bytes;
+        if (failed) w->stats[kind].errors++;
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+static void printStats(const char *name, const CommandStats *s, double seconds, int last) {
+    printf("    \"%s\": {\"count\": %llu, \"errors\": %llu, \"bytes\": %llu, \"throughput_rps\": %.1f, "
+           "\"p50_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu, \"max_us\": %llu}%s\n",
+           name, (unsigned long long)s->latency.total, (unsigned long long)s->errors,
+           (unsigned long long)s->bytes, s->latency.total / seconds,
+           (unsigned long long)histQuantile(&s->latency, 0.50), (unsigned long long)histQuantile(&s->latency, 0.99),
+           (unsigned long long)histQuantile(&s->latency, 0.999), (unsigned long long)s->latency.max,
+           last ? "" : ",");
+}
+
+static void runBench(const char *mix) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    char portStr[16];
+    snprintf(portStr, sizeof(portStr), "%d", bench.port);
+    int rc = getaddrinfo(bench.host, portStr, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "ERROR resolving %s: %s\n", bench.host, gai_strerror(rc));
+        exit(1);
+    }
+    memcpy(&bench.addr, res->ai_addr, res->ai_addrlen);
+    bench.addrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    Worker *workers = calloc(bench.conns, sizeof(Worker));
+    pthread_t *tids = calloc(bench.conns, sizeof(pthread_t));
+    if (!workers || !tids) error("ERROR allocating workers");
+    clock_gettime(CLOCK_MONOTONIC, &bench.deadline);
+    bench.deadline.tv_sec += bench.seconds;
+    uint64_t start = nowMicros();
+    for (int i = 0; i < bench.conns; i++) {
+        workers[i].seed = 7919 * (i + 1);
+        if (pthread_create(&tids[i], NULL, workerMain, &workers[i]) != 0) error("ERROR creating thread");
+    }
+    for (int i = 0; i < bench.conns; i++) pthread_join(tids[i], NULL);
+    double seconds = (nowMicros() - start) / 1e6;
+
+    CommandStats total, perKind[CMD_COUNT];
+    memset(&total, 0, sizeof(total));
+    memset(perKind, 0, sizeof(perKind));
+    for (int i = 0; i < bench.conns; i++) {
+        for (int k = 0; k < CMD_COUNT; k++) {
+            histMerge(&perKind[k].latency, &workers[i].stats[k].latency);
+            perKind[k].errors += workers[i].stats[k].errors;
+            perKind[k].bytes += workers[i].stats[k].bytes;
+        }
+    }
+    for (int k = 0; k < CMD_COUNT; k++) {
+        histMerge(&total.latency, &perKind[k].latency);
+        total.errors += perKind[k].errors;
+        total.bytes += perKind[k].bytes;
+    }
+
+    printf("{\n  \"host\": \"%s\", \"port\": %d, \"connections\": %d, \"seconds\": %.3f, \"mix\": \"%s\",\n",
+           bench.host, bench.port, bench.conns, seconds, mix);
+    printf("  \"commands\": {\n");
+    int shown = 0, active = 0;
+    for (int k = 0; k < CMD_COUNT; k++) active += bench.weights[k] > 0;
+    for (int k = 0; k < CMD_COUNT; k++)
+        if (bench.weights[k] > 0) printStats(commandNames[k], &perKind[k], seconds, ++shown == active);
+    printf("  },\n  \"total\": {\n");
+    printStats("all", &total, seconds, 1);
+    printf("  }\n}\n");
+    free(workers);
+    free(tids);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -g dir [-n files] [-d depth] [-w width] [-s min:max]\n", prog);
+    fprintf(stderr, "       %s [-H host] [-p port] [-c conns] [-t seconds] [-m mix] [-n files]\n", prog);
+    fprintf(stderr, "  -g dir      generate a synthetic tree of files under dir and exit\n");
+    fprintf(stderr, "  -n files    files in the tree (default %d); the run mode asks w24fn for these names\n",
+            DEFAULT_FILES);
+    fprintf(stderr, "  -d depth    directory levels below dir (default %d)\n", DEFAULT_DEPTH);
+    fprintf(stderr, "  -w width    subdirectories per directory (default %d)\n", DEFAULT_WIDTH);
+    fprintf(stderr, "  -s min:max  file sizes in bytes, log-uniform (default 1:1048576)\n");
+    fprintf(stderr, "  -H host     server to load (default 127.0.0.1)\n");
+    fprintf(stderr, "  -p port     server port (default %d)\n", DEFAULT_PORT);
+    fprintf(stderr, "  -c conns    concurrent connections (default 8)\n");
+    fprintf(stderr, "  -t seconds  duration of the run (default 10)\n");
+    fprintf(stderr, "  -m mix      weighted command mix (default %s)\n", DEFAULT_MIX);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *generate = NULL, *mix = DEFAULT_MIX;
+    int depth = DEFAULT_DEPTH, width = DEFAULT_WIDTH, opt;
+    long minSize = 1, maxSize = 1024 * 1024;
+
+    bench.host = "127.0.0.1";
+    bench.port = DEFAULT_PORT;
+    bench.conns = 8;
+    bench.seconds = 10;
+    bench.files = DEFAULT_FILES;
+    while ((opt = getopt(argc, argv, "g:n:d:w:s:H:p:c:t:m:")) != -1) {
+        if (opt == 'g') generate = optarg;
+        else if (opt == 'n') bench.files = atoi(optarg);
+        else if (opt == 'd') depth = atoi(optarg);
+        else if (opt == 'w') width = atoi(optarg);
+        else if (opt == 's' && sscanf(optarg, "%ld:%ld", &minSize, &maxSize) == 2) continue;
+        else if (opt == 'H') bench.host = optarg;
+        else if (opt == 'p') bench.port = atoi(optarg);
+        else if (opt == 'c') bench.conns = atoi(optarg);
+        else if (opt == 't') bench.seconds = atoi(optarg);
+        else if (opt == 'm') mix = optarg;
+        else usage(argv[0]);
+    }
+    if (optind < argc || bench.files <= 0 || depth < 0 || width <= 0 || minSize < 0 || maxSize < minSize ||
+        maxSize <= 0 || bench.conns <= 0 || bench.seconds <= 0 || parseMix(mix) < 0)
+        usage(argv[0]);
+
+    if (generate) generateTree(generate, bench.files, depth, width, minSize, maxSize);
+    else runBench(mix);
+    return 0;
+}
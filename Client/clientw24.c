@@ -7,8 +7,84 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
 
 #define BUFFER_SIZE 1024
+#define MAX_PIPELINE 64   // Requests kept in flight in pipelined mode
+#define MAX_SERVERS 8     // Primary plus mirrors in fan-out mode
+
+// Wire protocol: every message is a FrameHeader followed by length payload bytes.
+// Multi-byte fields travel big-endian. Server/serverw24.c carries the same definitions.
+#define FRAME_MAGIC 0x5734              // "W4"
+#define FRAME_VERSION 1
+
+enum {
+    OP_REQUEST = 0x01,  // Client -> server: text command
+    OP_TEXT    = 0x81,  // Server -> client: reply text
+    OP_ERROR   = 0x82,  // Server -> client: error text
+    OP_ARCHIVE = 0x83,  // Server -> client: an archive follows, payload is ArchiveInfo
+    OP_DATA    = 0x84,  // Server -> client: next chunk of archive bytes
+    OP_CHECKSUMS = 0x85,  // Server -> client: CRC-32 of every checkChunk bytes of the archive
+};
+#define FLAG_END 0x0001 // Last frame of the response to this request id
+
+typedef struct {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint16_t reserved;
+    uint32_t id;        // Chosen by the client, echoed on every response frame
+    uint32_t length;    // Payload bytes following the header
+} FrameHeader;
+
+// Payload of OP_ARCHIVE
+typedef struct {
+    uint64_t size;      // Total bytes carried by the DATA frames that follow
+    char name[64];      // Suggested local file name, NUL-terminated
+    uint64_t rawSize;   // Size of the tar stream before compression
+    char codec[16];     // Codec and level, e.g. "gzip:6", NUL-terminated
+    uint64_t contentId; // Names these exact archive bytes; '-r <id>:<offset>' resumes them
+    uint64_t offset;    // Archive offset of the first DATA byte, nonzero when resuming
+    uint32_t checkChunk;  // Bytes covered by each CRC-32 of the OP_CHECKSUMS frame
+    uint32_t checkCount;  // CRC-32 values in it
+} ArchiveInfo;
+
+// An archive being received into a local file
+typedef struct {
+    FILE *out;
+    char name[80];
+    char codec[16];
+    long long size, received, rawSize;
+    int lastPercent;
+    struct timespec start;     // When the ARCHIVE frame arrived, for the throughput report
+    int resumable;             // Received into a part file that survives an interrupted transfer
+    char part[40], meta[40];   // .w24-<hash>.part and .meta, named after the command
+    uint64_t contentId;
+    long long offset;          // Where this transfer picked up, 0 for a fresh one
+    uint32_t checkChunk, crcCount, *crcs;  // Checksums from the server, one per checkChunk bytes
+    uint32_t chunkCrc;         // Of the received bytes since the last chunk boundary
+    long long badChunk;        // Offset of the first chunk that failed its checksum, or -1
+} Download;
+
+// A request waiting for its response, matched by id
+typedef struct {
+    uint32_t id;               // 0 while the slot is free
+    char command[BUFFER_SIZE];
+    char *text;                // Reply text, buffered in pipelined mode
+    size_t textLen, textCap;
+    Download dl;
+} Pending;
+
+Pending pending[MAX_PIPELINE];
+int pipelined = 0;             // Many requests in flight, replies printed as they complete
 
 void error(const char *msg) {
     perror(msg);
@@ -18,7 +94,7 @@ void error(const char *msg) {
 // Function to check if the command is valid
 int isValidCommand(const char *cmd) {
     // Updated list of commands without w24fn since we'll check it separately
-    const char *validCommands[] = {"dirlist -a", "quitc", "dirlist -t", NULL};
+    const char *validCommands[] = {"dirlist -a", "quitc", "dirlist -t", "codecs", "stats", "w24sync", NULL};
 
     // Check fixed commands
     for (int i = 0; validCommands[i] != NULL; i++) {
@@ -27,46 +103,1040 @@ int isValidCommand(const char *cmd) {
         }
     }
     // Check if the command starts with "w24fn " (note the space after w24fn)
-    if (strncmp(cmd, "w24fn ", 6) == 0 || strncmp(cmd, "w24ft ", 6) == 0 || strncmp(cmd, "w24fz ", 6) == 0 || strncmp(cmd, "w24fdb ", 6) == 0 || strncmp(cmd, "w24fda ", 6) == 0){
+    if (strncmp(cmd, "w24fn ", 6) == 0 || strncmp(cmd, "w24ft ", 6) == 0 || strncmp(cmd, "w24fz ", 6) == 0 || strncmp(cmd, "w24fdb ", 6) == 0 || strncmp(cmd, "w24fda ", 6) == 0 || strncmp(cmd, "w24sync ", 8) == 0){
         return 1; // Command is valid if it starts with "w24fn "
     }
     return 0; // Command is not valid
 }
 
-int main(int argc, char *argv[]) {
-    int sockfd, portno, n;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
+// Reads exactly len bytes, returns -1 if the connection ends first
+int readFull(int sockfd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(sockfd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sends one command as a request frame
+void sendRequest(int sockfd, uint32_t id, const char *cmd) {
+    FrameHeader header = {
+        .magic = htons(FRAME_MAGIC), .version = FRAME_VERSION, .opcode = OP_REQUEST,
+        .id = htonl(id), .length = htonl(strlen(cmd)),
+    };
+    if (write(sockfd, &header, sizeof(header)) < 0 || write(sockfd, cmd, strlen(cmd)) < 0)
+        error("ERROR writing to socket");
+}
+
+int isArchiveCommand(const char *cmd) {
+    return strncmp(cmd, "w24ft ", 6) == 0 || strncmp(cmd, "w24fz ", 6) == 0 || strncmp(cmd, "w24fdb ", 7) == 0 ||
+           strncmp(cmd, "w24fda ", 7) == 0 || strcmp(cmd, "w24sync") == 0 || strncmp(cmd, "w24sync ", 8) == 0;
+}
+
+// CRC-32 as zlib computes it, which is what the server checksums archives with
+uint32_t crc32Update(uint32_t crc, const unsigned char *buf, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len-- > 0) crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Names the part file and its description after the command, so running it again finds them
+void partNames(const char *cmd, char *part, char *meta) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = cmd; *c; c++) hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    snprintf(part, 40, ".w24-%016llx.part", (unsigned long long)hash);
+    snprintf(meta, 40, ".w24-%016llx.meta", (unsigned long long)hash);
+}
+
+// Records what the part file of a fresh download will hold: the command, the content id, the size
+// and one checksum per chunk. Without it the download still completes, it just cannot resume.
+void writeResumeMeta(const Download *dl, const char *cmd) {
+    FILE *f = fopen(dl->meta, "w");
+    if (f == NULL) return;
+    fprintf(f, "w24resume 1\n%s\n%016llx %lld %u %u\n", cmd, (unsigned long long)dl->contentId, dl->size,
+            dl->checkChunk, dl->crcCount);
+    for (uint32_t i = 0; i < dl->crcCount; i++) fprintf(f, "%08x\n", dl->crcs[i]);
+    if (fclose(f) != 0) unlink(dl->meta);
+}
+
+// Looks for an interrupted download of cmd. Every chunk was checked as it arrived, so only the
+// tail of the part file can be torn: it is checked again, backing off chunk by chunk.
+// Sets *id and *offset to resume from and returns 0, or returns -1 when there is nothing to resume.
+int findResume(const char *cmd, uint64_t *id, long long *offset) {
+    char part[40], meta[40], line[BUFFER_SIZE + 2];
+    unsigned long long contentId;
+    long long size, resumeAt = -1;
+    unsigned chunk = 0, count = 0;
+    uint32_t *crcs = NULL;
+
+    partNames(cmd, part, meta);
+    FILE *f = fopen(meta, "r");
+    if (f == NULL) return -1;
+    size_t cmdLen = strlen(cmd);
+    int ok = fgets(line, sizeof(line), f) && strcmp(line, "w24resume 1\n") == 0 && fgets(line, sizeof(line), f) &&
+             strncmp(line, cmd, cmdLen) == 0 && line[cmdLen] == '\n' &&
+             fscanf(f, "%llx %lld %u %u", &contentId, &size, &chunk, &count) == 4 && chunk > 0 && size > 0 &&
+             count == (size + chunk - 1) / chunk && (crcs = malloc(count * sizeof(uint32_t))) != NULL;
+    for (unsigned i = 0; ok && i < count; i++) ok = fscanf(f, "%x", &crcs[i]) == 1;
+    fclose(f);
+
+    FILE *in = ok ? fopen(part, "rb") : NULL;
+    struct stat st;
+    unsigned char *buf = in ? malloc(chunk) : NULL;
+    if (buf && fstat(fileno(in), &st) == 0) {
+        long long full = st.st_size >= size ? count : st.st_size / chunk;
+        while (full > 0 && resumeAt < 0) {
+            long long at = (full - 1) * chunk;
+            size_t len = size - at < chunk ? size - at : chunk;
+            if (fseeko(in, at, SEEK_SET) == 0 && fread(buf, 1, len, in) == len && crc32Update(0, buf, len) == crcs[full - 1])
+                resumeAt = at + len;
+            else full--;
+        }
+    }
+    free(buf);
+    if (in) fclose(in);
+    free(crcs);
+    if (resumeAt <= 0) return -1;
+    *id = contentId;
+    *offset = resumeAt;
+    return 0;
+}
+
+// Fills dl from the ARCHIVE frame that announces it, without opening anything yet
+void describeDownload(Download *dl, const ArchiveInfo *info, uint32_t id) {
+    char name[sizeof(info->name)];
+    snprintf(name, sizeof(name), "%.*s", (int)sizeof(info->name) - 1, info->name);
+    // Never let the server pick a path outside the current directory
+    char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    if (base[0] == '\0' || strcmp(base, "..") == 0) base = "download.tar.gz";
+    // Concurrent archives in pipelined mode get the request id as a prefix
+    if (pipelined) snprintf(dl->name, sizeof(dl->name), "%u-%s", id, base);
+    else snprintf(dl->name, sizeof(dl->name), "%s", base);
+
+    dl->size = be64toh(info->size);
+    dl->rawSize = be64toh(info->rawSize);
+    snprintf(dl->codec, sizeof(dl->codec), "%.*s", (int)sizeof(info->codec) - 1, info->codec);
+    clock_gettime(CLOCK_MONOTONIC, &dl->start);
+    dl->contentId = be64toh(info->contentId);
+    dl->offset = be64toh(info->offset);
+    dl->checkChunk = ntohl(info->checkChunk);
+    dl->crcCount = ntohl(info->checkCount);
+    dl->chunkCrc = 0;
+    dl->badChunk = -1;
+    dl->received = dl->offset;
+    dl->lastPercent = -1;
+}
+
+// Opens the local file announced by an ARCHIVE frame in the current directory. A resumable
+// download goes to its part file instead, appended to from the offset the server resumes at.
+void startDownload(Download *dl, const ArchiveInfo *info, uint32_t id) {
+    describeDownload(dl, info, id);
+    if (!dl->resumable) {
+        dl->offset = dl->received = 0;
+        dl->out = fopen(dl->name, "wb");
+    } else if (dl->offset > 0) {
+        dl->out = fopen(dl->part, "r+b");
+        if (dl->out && (ftruncate(fileno(dl->out), dl->offset) < 0 || fseeko(dl->out, dl->offset, SEEK_SET) < 0))
+            error("ERROR reopening partial archive");
+    } else {
+        dl->out = fopen(dl->part, "wb");
+    }
+    if (dl->out == NULL) error("ERROR creating local archive");
+}
+
+// Runs bytes received at archive offset at through the per-chunk checksums.
+// The first chunk that does not match is remembered; nothing after it is kept.
+void verifyReceived(Download *dl, long long at, const unsigned char *buf, size_t len) {
+    while (len > 0 && dl->crcs && dl->badChunk < 0) {
+        size_t take = dl->checkChunk - at % dl->checkChunk;
+        if (take > len) take = len;
+        dl->chunkCrc = crc32Update(dl->chunkCrc, buf, take);
+        at += take;
+        buf += take;
+        len -= take;
+        if (at % dl->checkChunk != 0 && at != dl->size) continue;
+        long long chunk = (at - 1) / dl->checkChunk;
+        if (chunk >= dl->crcCount || dl->crcs[chunk] != dl->chunkCrc) dl->badChunk = chunk * dl->checkChunk;
+        dl->chunkCrc = 0;
+    }
+}
+
+// Copies a DATA frame payload from the socket into the download, with a progress line
+void receiveChunk(int sockfd, Download *dl, uint32_t len) {
+    char buffer[64 * 1024];
+    while (len > 0) {
+        size_t want = len < sizeof(buffer) ? len : sizeof(buffer);
+        if (readFull(sockfd, buffer, want) < 0) error("ERROR reading from socket");
+        verifyReceived(dl, dl->received, (unsigned char *)buffer, want);
+        if (dl->out && dl->badChunk < 0 && fwrite(buffer, 1, want, dl->out) != want)
+            error("ERROR writing local archive");
+        dl->received += want;
+        len -= want;
+    }
+    int percent = dl->size > 0 ? (int)(dl->received * 100 / dl->size) : 100;
+    if (percent != dl->lastPercent && !pipelined) {
+        printf("\rReceiving %s: %3d%% (%lld/%lld bytes)", dl->name, percent, dl->received, dl->size);
+        fflush(stdout);
+        dl->lastPercent = percent;
+    }
+}
+
+// Returns the pending slot for id, or NULL for a reply nobody is waiting for
+Pending *findPending(uint32_t id) {
+    for (int i = 0; i < MAX_PIPELINE; i++)
+        if (pending[i].id == id && id != 0) return &pending[i];
+    return NULL;
+}
+
+// Prints the outcome of a finished request and frees its slot
+void finishResponse(Pending *p) {
+    if (pipelined) {
+        printf("[%u] %s\n", p->id, p->command);
+        fwrite(p->text, 1, p->textLen, stdout);
+    }
+    if (p->dl.out) {
+        Download *dl = &p->dl;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - dl->start.tv_sec) + (end.tv_nsec - dl->start.tv_nsec) / 1e9;
+        const char *local = dl->resumable ? dl->part : dl->name;
+        const char *hint = dl->resumable ? "; run the same command again to resume" : "";
+        if (fclose(dl->out) != 0) error("ERROR writing local archive");
+        if (dl->badChunk >= 0) {
+            // Keep only the verified chunks, a resume fetches the rest again
+            if (truncate(local, dl->badChunk) < 0) perror("ERROR truncating local archive");
+            printf("%sChecksum mismatch in %s at offset %lld%s\n", pipelined ? "" : "\n", dl->name, dl->badChunk, hint);
+        } else if (dl->received == dl->size) {
+            if (dl->resumable && rename(dl->part, dl->name) < 0) perror("ERROR renaming local archive");
+            if (dl->resumable) unlink(dl->meta);
+            long long sent = dl->size - dl->offset;
+            printf("%sSaved %s (%lld bytes, %s, ratio %.2f, %.1f MB/s", pipelined ? "" : "\n", dl->name, dl->size,
+                   dl->codec, dl->size > 0 ? (double)dl->rawSize / dl->size : 0.0, secs > 0 ? sent / secs / 1e6 : 0.0);
+            if (dl->offset > 0) printf(", resumed at %lld", dl->offset);
+            printf(")\n");
+        } else {
+            printf("\nIncomplete archive %s: %lld of %lld bytes%s\n", dl->name, dl->received, dl->size, hint);
+        }
+    }
+    free(p->dl.crcs);
+    free(p->text);
+    memset(p, 0, sizeof(*p));
+}
+
+// Buffers reply text of p, keeping it NUL-terminated
+void appendText(Pending *p, const char *buf, size_t len) {
+    if (p->textLen + len + 1 > p->textCap) {
+        p->textCap = (p->textLen + len + 1) * 2;
+        p->text = realloc(p->text, p->textCap);
+        if (p->text == NULL) error("ERROR allocating reply buffer");
+    }
+    memcpy(p->text + p->textLen, buf, len);
+    p->textLen += len;
+    p->text[p->textLen] = '\0';
+}
+
+// Reads one frame and routes it to the request it answers.
+// Returns the id of the request this frame completed, or 0.
+uint32_t receiveFrame(int sockfd) {
+    char buffer[BUFFER_SIZE];
+    FrameHeader header;
+
+    if (readFull(sockfd, &header, sizeof(header)) < 0) error("ERROR reading from socket");
+    header.magic = ntohs(header.magic);
+    header.flags = ntohs(header.flags);
+    header.id = ntohl(header.id);
+    header.length = ntohl(header.length);
+    if (header.magic != FRAME_MAGIC || header.version != FRAME_VERSION) {
+        fprintf(stderr, "ERROR, malformed frame from server\n");
+        exit(1);
+    }
+
+    Pending *p = findPending(header.id);
+    uint32_t left = header.length;
+    if (p && header.opcode == OP_ARCHIVE && left == sizeof(ArchiveInfo)) {
+        ArchiveInfo info;
+        if (readFull(sockfd, &info, sizeof(info)) < 0) error("ERROR reading from socket");
+        startDownload(&p->dl, &info, p->id);
+        left = 0;
+    } else if (p && header.opcode == OP_CHECKSUMS && p->dl.out && left == p->dl.crcCount * sizeof(uint32_t)) {
+        p->dl.crcs = malloc(left + 1);
+        if (p->dl.crcs == NULL) error("ERROR allocating checksums");
+        if (readFull(sockfd, p->dl.crcs, left) < 0) error("ERROR reading from socket");
+        for (uint32_t i = 0; i < p->dl.crcCount; i++) p->dl.crcs[i] = ntohl(p->dl.crcs[i]);
+        if (p->dl.resumable && p->dl.offset == 0) writeResumeMeta(&p->dl, p->command);
+        left = 0;
+    } else if (p && header.opcode == OP_DATA) {
+        receiveChunk(sockfd, &p->dl, left);
+        left = 0;
+    }
+    // Text is printed (or buffered until the reply completes), anything else is skipped
+    while (left > 0) {
+        size_t want = left < sizeof(buffer) ? left : sizeof(buffer);
+        if (readFull(sockfd, buffer, want) < 0) error("ERROR reading from socket");
+        if (p && (header.opcode == OP_TEXT || header.opcode == OP_ERROR)) {
+            if (!pipelined) {
+                fwrite(buffer, 1, want, stdout);
+            } else {
+                appendText(p, buffer, want);
+            }
+        }
+        left -= want;
+    }
+
+    if (p && (header.flags & FLAG_END)) {
+        uint32_t id = p->id;
+        finishResponse(p);
+        return id;
+    }
+    return 0;
+}
+
+// Records a request in a free pending slot and sends it
+void startRequest(int sockfd, uint32_t id, const char *cmd) {
+    Pending *p = NULL;
+    for (int i = 0; i < MAX_PIPELINE && !p; i++)
+        if (pending[i].id == 0) p = &pending[i];
+    p->id = id;
+    snprintf(p->command, sizeof(p->command), "%s", cmd);
+
+    // An archive is received into a part file, unless the same command is already in flight,
+    // and an interrupted download of it is picked up with '-r <content id>:<offset>'
+    char wire[BUFFER_SIZE + 64];
+    snprintf(wire, sizeof(wire), "%s", cmd);
+    if (isArchiveCommand(cmd)) {
+        p->dl.resumable = 1;
+        for (int i = 0; i < MAX_PIPELINE; i++)
+            if (&pending[i] != p && pending[i].id != 0 && pending[i].dl.resumable && strcmp(pending[i].command, cmd) == 0)
+                p->dl.resumable = 0;
+        partNames(cmd, p->dl.part, p->dl.meta);
+        uint64_t contentId;
+        long long offset;
+        if (p->dl.resumable && findResume(cmd, &contentId, &offset) == 0) {
+            int verb = strcspn(cmd, " ");
+            snprintf(wire, sizeof(wire), "%.*s -r %016llx:%lld%s", verb, cmd, (unsigned long long)contentId, offset,
+                     cmd + verb);
+        }
+    }
+    sendRequest(sockfd, id, wire);
+}
+
+// Pipelined mode: keeps up to MAX_PIPELINE commands from stdin in flight on one connection
+// and prints each reply as soon as it completes, in whatever order the server finishes them.
+void runPipelined(int sockfd) {
     char buffer[BUFFER_SIZE];
+    uint32_t nextId = 1;
+    int inflight = 0, eof = 0;
+
+    pipelined = 1;
+    while (!eof || inflight > 0) {
+        while (!eof && inflight < MAX_PIPELINE) {
+            if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
+                eof = 1;
+                break;
+            }
+            buffer[strcspn(buffer, "\n")] = 0;
+            if (buffer[0] == '\0') continue;
+            if (strncmp(buffer, "quitc", 5) == 0) {
+                eof = 1;
+                break;
+            }
+            if (!isValidCommand(buffer)) {
+                printf("Invalid command: %s\n", buffer);
+                continue;
+            }
+            startRequest(sockfd, nextId++, buffer);
+            inflight++;
+        }
+        if (inflight > 0 && receiveFrame(sockfd) != 0) inflight--;
+    }
+    sendRequest(sockfd, nextId, "quitc");
+}
+
+// Fan-out mode: the primary and every mirror at once. One server of the fan-out, with the
+// non-blocking reader of its connection and the job it is working on.
+typedef struct {
+    char host[256];
+    char port[16];
+    struct addrinfo *addrs, *next;  // Addresses still to try while connecting
+    int fd;                    // -1 once the server is gone
+    unsigned char head[sizeof(FrameHeader)];
+    size_t headGot;            // Bytes of the next frame header read so far
+    FrameHeader frame;         // Current frame in host byte order, once its header is complete
+    uint32_t left;             // Payload bytes of the current frame still to come
+    ArchiveInfo info;          // Payload of an ARCHIVE frame, gathered across reads
+    size_t infoGot;
+    int busy;                  // Its job was sent and the END frame has not arrived
+    int failed;                // The job got an ERROR frame or lost its connection
+    Pending job;               // Reply text, and the archive part in a temporary file
+} Server;
+
+Server servers[MAX_SERVERS];
+int serverCount = 0;
+
+// How the replies of the jobs of one command become its output
+enum {
+    MERGE_NONE,     // A single job, its reply as is
+    MERGE_EACH,     // Every reply under a header naming its server
+    MERGE_SORTED,   // Union of the lines, sorted like 'dirlist -a'
+    MERGE_DATED,    // Union of the lines, by the timestamp that leads each line of 'dirlist -t'
+    MERGE_RECORDS,  // Union of the blank-line separated records of 'w24fn -a'
+    MERGE_FIRST,    // The first server that found something
+    MERGE_ARCHIVE,  // Archive parts joined into one local file
+};
 
-    if (argc < 3) {
-        fprintf(stderr,"usage %s hostname port\n", argv[0]);
+void initServer(Server *s, const char *host, const char *port) {
+    memset(s, 0, sizeof(*s));
+    snprintf(s->host, sizeof(s->host), "%s", host);
+    snprintf(s->port, sizeof(s->port), "%s", port);
+    s->fd = -1;
+}
+
+// Adds a mirror given as host:port or [v6address]:port
+void addServerSpec(const char *spec) {
+    char host[256];
+    const char *colon = spec[0] == '[' ? strstr(spec, "]:") : strrchr(spec, ':');
+    if (colon == NULL || colon == spec) {
+        fprintf(stderr, "ERROR, expected host:port, got '%s'\n", spec);
         exit(1);
     }
+    if (spec[0] == '[') snprintf(host, sizeof(host), "%.*s", (int)(colon - spec - 1), spec + 1);
+    else snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+    if (serverCount == MAX_SERVERS) {
+        fprintf(stderr, "ERROR, at most %d servers\n", MAX_SERVERS);
+        exit(1);
+    }
+    initServer(&servers[serverCount++], host, colon + (spec[0] == '[' ? 2 : 1));
+}
+
+// Starts a non-blocking connect to the next address of s.
+// Returns 1 when connected at once, 0 while in progress, -1 when no address is left.
+int startConnect(Server *s) {
+    while (s->next) {
+        struct addrinfo *ai = s->next;
+        s->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (s->fd >= 0) {
+            if (connect(s->fd, ai->ai_addr, ai->ai_addrlen) == 0) return 1;
+            if (errno == EINPROGRESS) return 0;
+            close(s->fd);
+        }
+        s->next = ai->ai_next;
+    }
+    s->fd = -1;
+    return -1;
+}
+
+// Connects to every server at the same time, trying each address getaddrinfo returns in turn.
+// Servers that cannot be reached are left with fd -1.
+void connectServers(void) {
+    struct pollfd pfds[MAX_SERVERS];
+    int idx[MAX_SERVERS], connecting[MAX_SERVERS] = {0};
+    int waiting = 0;
+
+    for (int i = 0; i < serverCount; i++) {
+        Server *s = &servers[i];
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+        int rc = getaddrinfo(s->host, s->port, &hints, &s->addrs);
+        if (rc != 0) {
+            fprintf(stderr, "ERROR, %s: %s\n", s->host, gai_strerror(rc));
+            s->addrs = NULL;
+            continue;
+        }
+        s->next = s->addrs;
+        if (startConnect(s) == 0) {
+            connecting[i] = 1;
+            waiting++;
+        }
+    }
+    while (waiting > 0) {
+        int n = 0;
+        for (int i = 0; i < serverCount; i++) {
+            if (!connecting[i]) continue;
+            pfds[n].fd = servers[i].fd;
+            pfds[n].events = POLLOUT;
+            idx[n++] = i;
+        }
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR waiting for connections");
+        }
+        for (int k = 0; k < n; k++) {
+            if (pfds[k].revents == 0) continue;
+            Server *s = &servers[idx[k]];
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                connecting[idx[k]] = 0;
+                waiting--;
+                continue;
+            }
+            close(s->fd);
+            s->next = s->next->ai_next;
+            if (startConnect(s) != 0) {
+                connecting[idx[k]] = 0;
+                waiting--;
+            }
+        }
+    }
+    for (int i = 0; i < serverCount; i++) {
+        if (servers[i].addrs && servers[i].fd < 0)
+            fprintf(stderr, "ERROR connecting to %s port %s\n", servers[i].host, servers[i].port);
+        if (servers[i].addrs) freeaddrinfo(servers[i].addrs);
+        servers[i].addrs = servers[i].next = NULL;
+    }
+}
+
+// Gives up on a server whose connection failed; its job counts as failed
+void dropServer(Server *s, const char *why) {
+    char msg[BUFFER_SIZE];
+    snprintf(msg, sizeof(msg), "ERROR, %s %s port %s\n", why, s->host, s->port);
+    appendText(&s->job, msg, strlen(msg));
+    if (s->job.dl.out) fclose(s->job.dl.out);
+    s->job.dl.out = NULL;
+    s->failed = 1;
+    s->busy = 0;
+    close(s->fd);
+    s->fd = -1;
+}
+
+// Hands one command to s
+void startJob(Server *s, uint32_t id, const char *cmd) {
+    memset(&s->job, 0, sizeof(s->job));
+    s->job.id = id;
+    snprintf(s->job.command, sizeof(s->job.command), "%s", cmd);
+    s->headGot = 0;
+    s->busy = 1;
+    s->failed = 0;
+    FrameHeader header = {
+        .magic = htons(FRAME_MAGIC), .version = FRAME_VERSION, .opcode = OP_REQUEST,
+        .id = htonl(id), .length = htonl(strlen(cmd)),
+    };
+    struct iovec iov[2] = { { &header, sizeof(header) }, { (void *)cmd, strlen(cmd) } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    // A request is far smaller than an idle socket's send buffer, so it goes out whole
+    if (sendmsg(s->fd, &msg, MSG_NOSIGNAL) != (ssize_t)(sizeof(header) + strlen(cmd)))
+        dropServer(s, "could not send to");
+}
+
+// Consumes bytes read from s: frame headers, then each payload routed by its opcode
+void feedServer(Server *s, const unsigned char *buf, size_t len) {
+    while (len > 0 && s->busy) {
+        if (s->headGot < sizeof(FrameHeader)) {
+            size_t take = sizeof(FrameHeader) - s->headGot;
+            if (take > len) take = len;
+            memcpy(s->head + s->headGot, buf, take);
+            s->headGot += take;
+            buf += take;
+            len -= take;
+            if (s->headGot < sizeof(FrameHeader)) return;
+            memcpy(&s->frame, s->head, sizeof(FrameHeader));
+            s->frame.magic = ntohs(s->frame.magic);
+            s->frame.flags = ntohs(s->frame.flags);
+            s->frame.id = ntohl(s->frame.id);
+            s->frame.length = ntohl(s->frame.length);
+            if (s->frame.magic != FRAME_MAGIC || s->frame.version != FRAME_VERSION) {
+                dropServer(s, "malformed frame from");
+                return;
+            }
+            s->left = s->frame.length;
+            s->infoGot = 0;
+            if (s->frame.id == s->job.id && s->frame.opcode == OP_ERROR) s->failed = 1;
+        } else {
+            size_t take = s->left < len ? s->left : len;
+            if (s->frame.id != s->job.id) {
+                // Not ours, skipped
+            } else if (s->frame.opcode == OP_ARCHIVE && s->infoGot + take <= sizeof(ArchiveInfo)) {
+                memcpy((char *)&s->info + s->infoGot, buf, take);
+                s->infoGot += take;
+            } else if (s->frame.opcode == OP_DATA && s->job.dl.out) {
+                if (fwrite(buf, 1, take, s->job.dl.out) != take) error("ERROR writing archive part");
+                s->job.dl.received += take;
+            } else if (s->frame.opcode == OP_TEXT || s->frame.opcode == OP_ERROR) {
+                appendText(&s->job, (const char *)buf, take);
+            }
+            buf += take;
+            len -= take;
+            s->left -= take;
+        }
+        if (s->left > 0) continue;
+
+        // Frame complete
+        if (s->frame.id == s->job.id && s->frame.opcode == OP_ARCHIVE && s->infoGot == sizeof(ArchiveInfo)) {
+            describeDownload(&s->job.dl, &s->info, s->job.id);
+            s->job.dl.out = tmpfile();
+            if (s->job.dl.out == NULL) error("ERROR creating archive part");
+        }
+        s->headGot = 0;
+        if (s->frame.id == s->job.id && (s->frame.flags & FLAG_END)) s->busy = 0;
+    }
+}
+
+// Receives from every busy server as its data arrives, until all of them have finished their jobs
+void waitJobs(void) {
+    struct pollfd pfds[MAX_SERVERS];
+    int idx[MAX_SERVERS], lastPercent = -1;
+    static unsigned char buf[256 * 1024];
 
-    portno = atoi(argv[2]);
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) error("ERROR opening socket");
+    for (;;) {
+        int n = 0;
+        for (int i = 0; i < serverCount; i++) {
+            if (!servers[i].busy) continue;
+            pfds[n].fd = servers[i].fd;
+            pfds[n].events = POLLIN;
+            idx[n++] = i;
+        }
+        if (n == 0) break;
+        if (poll(pfds, n, -1) < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR waiting for servers");
+        }
+        for (int k = 0; k < n; k++) {
+            if (pfds[k].revents == 0) continue;
+            Server *s = &servers[idx[k]];
+            ssize_t got = read(s->fd, buf, sizeof(buf));
+            if (got < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (got <= 0) dropServer(s, "lost connection to");
+            else feedServer(s, buf, got);
+        }
+
+        // One progress line for all parts being received
+        long long size = 0, received = 0;
+        int parts = 0;
+        for (int i = 0; i < serverCount; i++) {
+            if (!servers[i].job.dl.out) continue;
+            size += servers[i].job.dl.size;
+            received += servers[i].job.dl.received;
+            parts++;
+        }
+        int percent = size > 0 ? (int)(received * 100 / size) : 100;
+        if (parts > 0 && percent != lastPercent) {
+            printf("\rReceiving %d part%s: %3d%% (%lld/%lld bytes)", parts, parts > 1 ? "s" : "", percent,
+                   received, size);
+            fflush(stdout);
+            lastPercent = percent;
+        }
+    }
+    if (lastPercent >= 0) printf("\n");
+}
+
+// Raises b to the small non-negative power e
+double powerOf(double b, int e) {
+    double r = 1;
+    while (e-- > 0) r *= b;
+    return r;
+}
+
+// Copies the leading '-z spec' options of an archive command into opts and returns the rest.
+// A '-p' typed by the user is dropped; shards ask for parts themselves.
+const char *takeArchiveOptions(const char *args, char *opts, size_t len) {
+    size_t used = 0;
+    opts[0] = '\0';
+    for (;;) {
+        if (strncmp(args, "-p ", 3) == 0) {
+            args += 3;
+        } else if (strncmp(args, "-z ", 3) == 0) {
+            size_t specLen = strcspn(args + 3, " ");
+            used += snprintf(opts + used, used < len ? len - used : 0, " -z %.*s", (int)specLen, args + 3);
+            args += 3 + specLen;
+        } else {
+            return args;
+        }
+        while (*args == ' ') args++;
+    }
+}
 
-    server = gethostbyname(argv[1]);
-    if (server == NULL) {
-        fprintf(stderr,"ERROR, no such host\n");
+// Splits cmd into jobs for n servers and sets *merge to how their replies combine.
+// A w24ft with several extensions is sharded by extension and a w24fz by size range, each shard
+// asking for a part archive with '-p'. Listings and stats go to every server. Anything else is a
+// single job. Returns the number of jobs, and *split when the archive comes in parts.
+int planJobs(const char *cmd, int n, char jobs[][BUFFER_SIZE], int *merge, int *split) {
+    char opts[128];    // "-z spec" options shared by the shards
+    *split = 0;
+    *merge = MERGE_NONE;
+
+    if (strcmp(cmd, "stats") == 0 || strncmp(cmd, "dirlist ", 8) == 0 || strncmp(cmd, "w24fn ", 6) == 0) {
+        if (strcmp(cmd, "stats") == 0) *merge = MERGE_EACH;
+        else if (strcmp(cmd, "dirlist -a") == 0) *merge = MERGE_SORTED;
+        else if (strncmp(cmd, "dirlist ", 8) == 0) *merge = MERGE_DATED;
+        else if (strncmp(cmd, "w24fn -a ", 9) == 0) *merge = MERGE_RECORDS;
+        else *merge = MERGE_FIRST;
+        for (int j = 0; j < n; j++) snprintf(jobs[j], BUFFER_SIZE, "%s", cmd);
+        return n;
+    }
+    if (strcmp(cmd, "codecs") != 0) *merge = MERGE_ARCHIVE;
+
+    if (strncmp(cmd, "w24ft ", 6) == 0) {
+        const char *args = takeArchiveOptions(cmd + 6, opts, sizeof(opts));
+        char *ext[BUFFER_SIZE / 2], copy[BUFFER_SIZE], *save;
+        int group[BUFFER_SIZE / 2], count = 0, groups = 0;
+        snprintf(copy, sizeof(copy), "%s", args);
+        for (char *t = strtok_r(copy, " ", &save); t; t = strtok_r(NULL, " ", &save)) {
+            // Extensions equal but for case stay together, whatever the server's -i setting
+            group[count] = -1;
+            for (int i = 0; i < count && group[count] < 0; i++)
+                if (strcasecmp(ext[i], t) == 0) group[count] = group[i];
+            if (group[count] < 0) group[count] = groups++;
+            ext[count++] = t;
+        }
+        int shards = groups < n ? groups : n;
+        if (shards > 1) {
+            for (int j = 0; j < shards; j++) {
+                size_t len = snprintf(jobs[j], BUFFER_SIZE, "w24ft -p%s", opts);
+                for (int i = 0; i < count; i++)
+                    if (group[i] % shards == j && len < BUFFER_SIZE)
+                        len += snprintf(jobs[j] + len, BUFFER_SIZE - len, " %s", ext[i]);
+            }
+            *split = 1;
+            return shards;
+        }
+    } else if (strncmp(cmd, "w24fz ", 6) == 0) {
+        const char *args = takeArchiveOptions(cmd + 6, opts, sizeof(opts));
+        long size1, size2;
+        if (sscanf(args, "%ld %ld", &size1, &size2) == 2 && size1 < size2 && size2 - size1 > 2) {
+            // Sizes size1+1 .. size2-1, cut at geometric steps since file sizes spread over decades
+            long lo = size1 + 1, hi = size2 - 1;
+            int shards = hi - lo + 1 < n ? (int)(hi - lo + 1) : n;
+            double base = lo > 1 ? lo : 1, top = (double)hi + 1, root = 1, upper = top / base;
+            for (int i = 0; i < 64; i++) {
+                double mid = (root + upper) / 2;
+                if (powerOf(mid, shards) < top / base) root = mid;
+                else upper = mid;
+            }
+            long cut[MAX_SERVERS + 1];
+            cut[0] = lo;
+            cut[shards] = hi + 1;
+            for (int j = 1; j < shards; j++) {
+                cut[j] = (long)(base * powerOf(root, j));
+                if (cut[j] <= cut[j - 1]) cut[j] = cut[j - 1] + 1;
+                if (cut[j] > hi + 1 - (shards - j)) cut[j] = hi + 1 - (shards - j);
+            }
+            for (int j = 0; j < shards; j++)
+                snprintf(jobs[j], BUFFER_SIZE, "w24fz -p%s %ld %ld", opts, cut[j] - 1, cut[j + 1]);
+            *split = shards > 1;
+            return shards;
+        }
+    }
+    snprintf(jobs[0], BUFFER_SIZE, "%s", cmd);
+    return 1;
+}
+
+// A line of a listing or a record of 'w24fn -a', with its position among all of them
+typedef struct {
+    const char *text;
+    size_t order;
+    int duplicate;
+} Item;
+
+int itemTextSort(const void *a, const void *b) {
+    const Item *x = a, *y = b;
+    int c = strcmp(x->text, y->text);
+    return c ? c : (x->order > y->order) - (x->order < y->order);
+}
+
+int itemOrderSort(const void *a, const void *b) {
+    const Item *x = a, *y = b;
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+// 'dirlist -t' lines start with a "YYYY-MM-DD HH:MM:SS" timestamp; equal ones keep their order
+int itemDateSort(const void *a, const void *b) {
+    const Item *x = a, *y = b;
+    int c = strncmp(x->text, y->text, 19);
+    return c ? c : itemOrderSort(a, b);
+}
+
+int itemAlphaSort(const void *a, const void *b) {
+    const Item *x = a, *y = b;
+    int c = strcasecmp(x->text, y->text);
+    return c ? c : strcmp(x->text, y->text);
+}
+
+// Prints the union of the items in the replies of the jobs, each once and ordered by order:
+// lines, or records that are separated by a blank line
+void printUnion(Server **jobs, int count, int records, int (*order)(const void *, const void *)) {
+    Item *items = NULL;
+    size_t n = 0, cap = 0;
+    for (int j = 0; j < count; j++) {
+        char *t = jobs[j]->job.text;
+        while (!jobs[j]->failed && t && *t) {
+            char *end = records ? strstr(t, "\n\n") : strchr(t, '\n');
+            if (end) *(records ? end + 1 : end) = '\0';
+            if (n == cap) {
+                cap = cap ? cap * 2 : 256;
+                items = realloc(items, cap * sizeof(Item));
+                if (items == NULL) error("ERROR allocating listing");
+            }
+            items[n] = (Item){ t, n, 0 };
+            n++;
+            t = end ? end + (records ? 2 : 1) : t + strlen(t);
+        }
+    }
+    // Sorting by text puts duplicates next to each other; the first to arrive is kept
+    qsort(items, n, sizeof(Item), itemTextSort);
+    for (size_t i = 1; i < n; i++)
+        if (strcmp(items[i].text, items[i - 1].text) == 0) items[i].duplicate = 1;
+    qsort(items, n, sizeof(Item), order);
+    int first = 1;
+    for (size_t i = 0; i < n; i++) {
+        if (items[i].duplicate) continue;
+        if (records) printf("%s%s", first ? "" : "\n", items[i].text);
+        else printf("%s\n", items[i].text);
+        first = 0;
+    }
+    free(items);
+}
+
+// Prints the distinct error replies of the failed jobs. skipNoMatch leaves out shards that merely
+// found nothing, as long as another one did.
+void printErrors(Server **jobs, int count, int skipNoMatch) {
+    for (int j = 0; j < count; j++) {
+        const char *text = jobs[j]->job.text ? jobs[j]->job.text : "";
+        if (!jobs[j]->failed) continue;
+        if (skipNoMatch && strncmp(text, "No matching files", 17) == 0) continue;
+        int seen = 0;
+        for (int i = 0; i < j && !seen; i++)
+            seen = jobs[i]->failed && jobs[i]->job.text && strcmp(jobs[i]->job.text, text) == 0;
+        if (!seen) fputs(text, stdout);
+    }
+}
+
+// Closes a merged archive with the tar end-of-archive blocks, 1024 zero bytes, that the parts
+// left out. They are written as one more member of the codec's stream, and concatenated gzip
+// members, zstd frames and lz4 frames all decode as a single stream.
+int writeTarEnd(FILE *out, const char *codec) {
+    static const unsigned char gzipEnd[] = {
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x63, 0x60, 0x18, 0x05, 0xa3,
+        0x60, 0x14, 0x8c, 0x54, 0x00, 0x00, 0x2e, 0xaf, 0xb5, 0xef, 0x00, 0x04, 0x00, 0x00,
+    };
+    // A zstd frame of one RLE block repeating a zero byte 1024 times
+    static const unsigned char zstdEnd[] = { 0x28, 0xb5, 0x2f, 0xfd, 0x60, 0x00, 0x03, 0x03, 0x20, 0x00, 0x00 };
+    // An lz4 frame header, one stored block of 1024 bytes and the end mark
+    static const unsigned char lz4Head[] = { 0x04, 0x22, 0x4d, 0x18, 0x60, 0x40, 0x82, 0x00, 0x04, 0x00, 0x80 };
+    static const unsigned char zeros[1024 + 4];
+    size_t nameLen = strcspn(codec, ":");
+
+    if (strncmp(codec, "gzip", nameLen) == 0) return fwrite(gzipEnd, sizeof(gzipEnd), 1, out) == 1 ? 0 : -1;
+    if (strncmp(codec, "zstd", nameLen) == 0) return fwrite(zstdEnd, sizeof(zstdEnd), 1, out) == 1 ? 0 : -1;
+    if (strncmp(codec, "lz4", nameLen) == 0 && fwrite(lz4Head, sizeof(lz4Head), 1, out) != 1) return -1;
+    if (strncmp(codec, "lz4", nameLen) == 0 || strncmp(codec, "none", nameLen) == 0)
+        return fwrite(zeros, strncmp(codec, "lz4", nameLen) == 0 ? 1024 + 4 : 1024, 1, out) == 1 ? 0 : -1;
+    return -1;
+}
+
+// Joins the archive parts of the jobs, in job order, into the local file the first one names.
+// Parts are tar streams without their end-of-archive blocks, so split archives get them appended.
+void mergeArchive(Server **jobs, int count, int split) {
+    Download merged = { 0 };
+    int parts = 0, missing = 0;
+    char buffer[64 * 1024];
+
+    for (int j = 0; j < count; j++) {
+        Download *dl = &jobs[j]->job.dl;
+        if (dl->out && dl->received != dl->size) {
+            char msg[BUFFER_SIZE];
+            snprintf(msg, sizeof(msg), "Incomplete archive part from %s port %s: %lld of %lld bytes\n",
+                     jobs[j]->host, jobs[j]->port, dl->received, dl->size);
+            appendText(&jobs[j]->job, msg, strlen(msg));
+            jobs[j]->failed = 1;
+        }
+        if (jobs[j]->failed || !dl->out) {
+            if (jobs[j]->failed && strncmp(jobs[j]->job.text ? jobs[j]->job.text : "", "No matching files", 17) != 0)
+                missing++;
+            continue;
+        }
+        if (parts++ == 0) {
+            merged = *dl;
+            merged.size = merged.rawSize = 0;
+            merged.out = fopen(merged.name, "wb");
+            if (merged.out == NULL) error("ERROR creating local archive");
+        }
+        rewind(dl->out);
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), dl->out)) > 0)
+            if (fwrite(buffer, 1, n, merged.out) != n) error("ERROR writing local archive");
+        merged.size += dl->size;
+        merged.rawSize += dl->rawSize;
+    }
+    // Text alongside an archive, such as the token and deletions of a w24sync, is shown as is
+    for (int j = 0; j < count; j++)
+        if (!jobs[j]->failed && jobs[j]->job.text) fputs(jobs[j]->job.text, stdout);
+    printErrors(jobs, count, parts > 0);
+    if (parts == 0) return;
+
+    if (split) {
+        if (writeTarEnd(merged.out, merged.codec) < 0) error("ERROR finishing local archive");
+        merged.rawSize += 1024;
+    }
+    merged.size = ftell(merged.out);
+    if (fclose(merged.out) != 0) error("ERROR writing local archive");
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - merged.start.tv_sec) + (end.tv_nsec - merged.start.tv_nsec) / 1e9;
+    printf("Saved %s (%lld bytes from %d server%s, %s, ratio %.2f, %.1f MB/s)\n", merged.name, merged.size, parts,
+           parts > 1 ? "s" : "", merged.codec, merged.size > 0 ? (double)merged.rawSize / merged.size : 0.0,
+           secs > 0 ? merged.size / secs / 1e6 : 0.0);
+    if (missing) printf("WARNING, %s lacks the files of %d failed part%s\n", merged.name, missing, missing > 1 ? "s" : "");
+}
+
+// Which server announced each recent archive, so a '-r <content id>:<offset>' resume reaches
+// the cache that holds it
+#define SERVED_ARCHIVES 64
+struct {
+    uint64_t contentId;
+    int server;
+} servedArchives[SERVED_ARCHIVES];
+int servedNext;
+
+// Returns the server a single job must go to, or -1 if any will do. A w24sync token belongs to
+// the epoch of the server that issued it, and a resume id names an entry in one server's cache.
+int pinnedServer(const char *cmd, int syncServer) {
+    if (strcmp(cmd, "w24sync") == 0 || strncmp(cmd, "w24sync ", 8) == 0) return syncServer;
+    const char *r = strstr(cmd, " -r ");
+    unsigned long long contentId;
+    if (!isArchiveCommand(cmd) || !r || sscanf(r + 4, "%llx:", &contentId) != 1) return -1;
+    for (int i = 0; i < SERVED_ARCHIVES; i++)
+        if (servedArchives[i].contentId == contentId && contentId != 0) return servedArchives[i].server;
+    return 0;
+}
+
+// Fan-out mode: every command from stdin is split into jobs for the connected servers, the jobs
+// run concurrently and their replies are merged into one answer
+void runFanOut(void) {
+    char buffer[BUFFER_SIZE];
+    static char cmds[MAX_SERVERS][BUFFER_SIZE];
+    Server *jobs[MAX_SERVERS];
+    uint32_t nextId = 1;
+    int rotor = 0;
+    int syncServer = 0;  // Issued the token of the last w24sync
+
+    while (1) {
+        printf("$clientw24: ");
+        if (fgets(buffer, sizeof(buffer), stdin) == NULL) break;
+        buffer[strcspn(buffer, "\n")] = 0;
+        if (!isValidCommand(buffer)) {
+            printf("Invalid command.\n");
+            continue;
+        }
+        uint32_t id = nextId++;
+        if (strncmp(buffer, "quitc", 5) == 0) {
+            for (int i = 0; i < serverCount; i++)
+                if (servers[i].fd >= 0) startJob(&servers[i], id, buffer);
+            break;
+        }
+
+        int live[MAX_SERVERS], n = 0;
+        for (int i = 0; i < serverCount; i++)
+            if (servers[i].fd >= 0) live[n++] = i;
+        if (n == 0) {
+            fprintf(stderr, "ERROR, no server left\n");
+            exit(1);
+        }
+        int merge, split;
+        int count = planJobs(buffer, n, cmds, &merge, &split);
+        // Listings keep the primary first; single jobs and shards start at a rotating server.
+        // w24sync goes back to the server that answered the last one and a resume to the server
+        // that sent the archive, or to the primary; a pinned server that is gone falls back to the
+        // first live one.
+        int first = count == n && merge != MERGE_ARCHIVE ? 0 : rotor++ % n;
+        int pinned = count == 1 ? pinnedServer(buffer, syncServer) : -1;
+        if (pinned >= 0) {
+            first = 0;
+            for (int k = 0; k < n; k++)
+                if (live[k] == pinned) first = k;
+        }
+        for (int j = 0; j < count; j++) {
+            jobs[j] = &servers[live[(first + j) % n]];
+            startJob(jobs[j], id, cmds[j]);
+        }
+        waitJobs();
+
+        int found = -1;
+        for (int j = 0; j < count && found < 0; j++)
+            if (!jobs[j]->failed) found = j;
+        if (merge == MERGE_ARCHIVE) {
+            mergeArchive(jobs, count, split);
+        } else if (found < 0 && merge != MERGE_EACH) {
+            printErrors(jobs, count, 0);
+        } else if (merge == MERGE_EACH) {
+            for (int j = 0; j < count; j++)
+                printf("== %s port %s ==\n%s", jobs[j]->host, jobs[j]->port, jobs[j]->job.text ? jobs[j]->job.text : "");
+        } else if (merge == MERGE_NONE || merge == MERGE_FIRST) {
+            fputs(jobs[found]->job.text ? jobs[found]->job.text : "", stdout);
+        } else {
+            printUnion(jobs, count, merge == MERGE_RECORDS, merge == MERGE_SORTED ? itemAlphaSort
+                                                            : merge == MERGE_DATED ? itemDateSort : itemOrderSort);
+        }
+        for (int j = 0; j < count; j++) {
+            if (jobs[j]->failed) continue;
+            if (jobs[j]->job.dl.contentId != 0) {
+                servedArchives[servedNext % SERVED_ARCHIVES].contentId = jobs[j]->job.dl.contentId;
+                servedArchives[servedNext++ % SERVED_ARCHIVES].server = jobs[j] - servers;
+            }
+            if (strcmp(buffer, "w24sync") == 0 || strncmp(buffer, "w24sync ", 8) == 0) syncServer = jobs[j] - servers;
+        }
+        for (int j = 0; j < count; j++) {
+            if (jobs[j]->job.dl.out) fclose(jobs[j]->job.dl.out);
+            free(jobs[j]->job.text);
+            memset(&jobs[j]->job, 0, sizeof(jobs[j]->job));
+        }
+    }
+    for (int i = 0; i < serverCount; i++)
+        if (servers[i].fd >= 0) close(servers[i].fd);
+}
+
+int main(int argc, char *argv[]) {
+    int sockfd, opt, pipeline = 0;
+    uint32_t nextId = 1;
+    char buffer[BUFFER_SIZE];
+
+    serverCount = 1;  // servers[0] is the primary; it leads merged listings
+    while ((opt = getopt(argc, argv, "ps:")) != -1) {
+        if (opt == 'p') pipeline = 1;
+        else if (opt == 's') addServerSpec(optarg);
+        else optind = argc + 1;
+    }
+    if (optind + 2 != argc || (pipeline && serverCount > 1)) {
+        fprintf(stderr,"usage %s hostname port [-p | -s host:port ...]\n", argv[0]);
+        fprintf(stderr,"  -p  pipeline commands read from stdin over one connection\n");
+        fprintf(stderr,"  -s  also use the mirror at host:port; commands fan out to every server\n");
+        fprintf(stderr,"      and their replies are merged\n");
         exit(1);
     }
+    initServer(&servers[0], argv[optind], argv[optind + 1]);
 
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(portno);
+    connectServers();
+    if (serverCount > 1) {
+        runFanOut();
+        return 0;
+    }
+    sockfd = servers[0].fd;
+    if (sockfd < 0) exit(1);
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
 
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) 
-        error("ERROR connecting");
+    if (pipeline) {
+        runPipelined(sockfd);
+        close(sockfd);
+        return 0;
+    }
 
     // Inside your main while loop, you already send any input to the server:
     while (1) {
         printf("$clientw24: ");
         bzero(buffer, BUFFER_SIZE);
-        fgets(buffer, BUFFER_SIZE - 1, stdin);
+        if (fgets(buffer, BUFFER_SIZE - 1, stdin) == NULL) break; // End of input
         buffer[strcspn(buffer, "\n")] = 0; // Remove newline character from the end
         
         if (!isValidCommand(buffer)) {
@@ -74,28 +1144,17 @@ int main(int argc, char *argv[]) {
             continue; // Skip sending invalid command
         }
 
-        // Send valid command to the server
-        n = write(sockfd, buffer, strlen(buffer));
-        if (n < 0) error("ERROR writing to socket");
-
         // Quit command issued by client
-        if (strncmp(buffer, "quitc", 5) == 0) break;
-
-        // Print server's response
-        do {
-            bzero(buffer, BUFFER_SIZE);
-            n = read(sockfd, buffer, BUFFER_SIZE - 1);
-            if (n > 0) {
-                printf("%s", buffer);  // Print server's response
-            }
-        } while (n > 0);  // Continue reading until no more data
-
-        if (strcmp(buffer, "END") == 0) {
-            continue; // Prepare for next command
+        uint32_t id = nextId++;
+        if (strncmp(buffer, "quitc", 5) == 0) {
+            sendRequest(sockfd, id, buffer);
+            break;
         }
 
-        if (n < 0 && errno != EAGAIN) error("ERROR reading from socket");
-        }
+        // Send valid command to the server and print its response, which ends with a frame flagged END
+        startRequest(sockfd, id, buffer);
+        while (receiveFrame(sockfd) != id);
+    }
     close(sockfd);
     return 0;
 }
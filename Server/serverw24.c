@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 700  // For broader POSIX compatibility, including nftw and DT_DIR
+#define _GNU_SOURCE  // For accept4 and broader POSIX compatibility, including DT_DIR
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>  // For TCP_USER_TIMEOUT
 #include <signal.h>
 #include <dirent.h>  // For DT_DIR
 #include <sys/stat.h>
@@ -14,40 +15,519 @@
 #include <sys/wait.h>
 #include <ctype.h>
 #include <time.h>
-#include <ftw.h>  // For nftw
 #include <glob.h>   // For glob() function
 #include <utime.h>
+#include <sys/inotify.h>  // For keeping the metadata index current
+#include <errno.h>
+#include <limits.h>  // For PATH_MAX
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>  // For raising the descriptor limit
+#include <zlib.h>  // For the built-in tar.gz writer
+#ifdef HAVE_ZSTD
+#include <zstd.h>  // Optional archive codec, build with -DHAVE_ZSTD -lzstd
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>  // Optional archive codec, build with -DHAVE_LZ4 -llz4
+#endif
+#include <sys/sendfile.h>
+#include <sys/uio.h>  // For writev
+#include <stdint.h>
+#include <endian.h>
+#include <stddef.h>  // For offsetof
+#include <sys/syscall.h>  // For getdents64 and io_uring
+#include <sys/mman.h>
+#include <linux/io_uring.h>  // Raw io_uring interface for batched statx
+#ifdef __SSE2__
+#include <emmintrin.h>  // For the vectorized extension classifier
+#endif
+#include <stdatomic.h>  // For the load counters reported to the primary
+#include <sys/un.h>  // For the primary-mirror control sockets
+#include <sys/timerfd.h>  // For the mirror health check
+#include <sys/eventfd.h>  // For waking the event loop when an index crawl lands
 
 #define BUFFER_SIZE 256
-#define PORT_NO 2024
-#define MAX_DIRS 512
+#define PORT_NO 2024       // Default listening port, override with -p
+#define MAX_EVENTS 256     // epoll events handled per wakeup
+#define MIN_WORKERS 4      // Lower bound on the worker thread pool
+#define TAR_BLOCK 512
+#define ARCHIVE_CHUNK (128 * 1024)  // Tar header scratch space of the archive writer
+#define GZIP_DICT (32 * 1024)       // Preceding input that primes each gzip block, the deflate window
+#define ARCHIVE_CACHE_BUDGET (256L * 1024 * 1024)  // Default disk budget of cached archives, override with -c
+#define ARCHIVE_CACHE_TTL 600        // Seconds an unused cached archive is kept, override with -t
+#define CACHE_RECLAIM_INTERVAL 30    // Longest pause of the reclaim thread, in seconds
+#define CHANGE_JOURNAL_SIZE 65536    // Index changes remembered for w24sync; older tokens expire
+#define INDEX_SNAPSHOT_INTERVAL 60   // Seconds between snapshots of a changed index
+#define INDEX_SNAPSHOT_VERSION 1     // Bumped whenever the snapshot layout changes
+#define MAX_MIRRORS 8
+#define MAX_CONTROL_PEERS 4      // Primaries a mirror accepts control links from
+#define HEALTH_INTERVAL_MS 1000  // Ping period on each mirror control link
+#define HEALTH_MAX_MISSED 3      // Unanswered pings before a mirror leaves rotation
 #ifndef DT_DIR
 #define DT_DIR 4
 #endif
+#define ARENA_CHUNK (64 * 1024)  // Default size of a request arena chunk
+
+// Bump allocator owned by a worker thread and reset after every request, so per-entry
+// allocations cost a pointer increment and teardown is a single reset
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;   // Older chunk
+    size_t used, size;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;          // Chunk being carved, newest first
+    void *last;                // Most recent allocation, which can grow in place
+} Arena;
+
+// Strings packed back to back in one growable arena buffer and addressed by offsets,
+// so a result set of any size takes two allocations instead of one per entry
+typedef struct {
+    Arena *arena;
+    char *bytes;
+    size_t len, cap;
+    uint32_t *offsets;
+    size_t count, offsetCap;
+} StringList;
+
+// A directory known to the metadata index
+typedef struct {
+    char *path;      // Absolute path
+    int parent;      // Index of the parent directory, -1 for the root
+    int wd;          // inotify watch descriptor, -1 if not watched
+    int live;
+    int64_t stamp;   // mtime in ns before its entries were last read, 0 if they must be read again
+    int firstFile;   // Head of the list of its live files, -1 if none
+    int firstChild;  // Head of the list of its live subdirectories, -1 if none
+    int nextSibling, prevSibling;  // Neighbours in the parent's list of subdirectories, -1 at the ends
+} IndexDir;
+
+// A basename interned in the metadata index: stored once however many files share it,
+// and the head of the chain linking those files for w24fn lookups
+typedef struct IndexName {
+    uint32_t hash;
+    int refs;        // Live files with this name
+    int firstFile;   // First file in the chain, -1 when refs is 0
+    char str[];
+} IndexName;
+
+// An extension with its posting list, the files w24ft finds for it
+typedef struct IndexExt {
+    uint32_t hash;
+    int *ids;        // Live files with this extension, unordered
+    int count, cap;
+    char str[];      // Lowercase when the index folds case
+} IndexExt;
+
+// A regular file known to the metadata index
+typedef struct {
+    const char *name;   // Basename, owned by the interned record
+    IndexName *interned;
+    const char *ext;    // Points into name just past the last '.', NULL if there is none
+    IndexExt *extEntry; // Posting list holding this file, NULL without an extension
+    int extPos;         // Position in that posting list
+    int nextSame, prevSame;  // Neighbours in the chain of files sharing the basename, -1 at the ends
+    int nextInDir, prevInDir;  // Neighbours in the containing directory's list of files, -1 at the ends
+    int dir;            // Index of the containing directory
+    off_t size;
+    time_t mtime;
+    long mtimeNsec;     // Sub-second part of the mtime, so date cutoffs compare exactly
+    mode_t mode;
+    int live;
+    uint32_t version;   // Bumped whenever an ordered key changes, retiring the old ordered entries
+} IndexFile;
+
+// One entry of an ordered index; it is current only while its file still has this version
+typedef struct {
+    int64_t key;
+    int id;
+    uint32_t version;
+} OrderedEntry;
 
+// File ids ordered by one attribute, for range queries. Inserts land in a small unsorted
+// delta that is merged into the sorted array once it grows; superseded entries are left
+// in place and dropped by the next merge.
+typedef struct {
+    OrderedEntry *sorted;
+    size_t count, cap;
+    OrderedEntry *delta;
+    size_t deltaCount, deltaCap;
+    size_t stale;          // Superseded entries still in either array
+    int mapped;            // sorted lies in the index snapshot mapping and is not owned
+} OrderedIndex;
+
+// Growable list of file ids
+typedef struct {
+    int *ids;
+    size_t count, cap;
+} IdList;
+
+// In-memory metadata index of the served tree, kept current with inotify
+struct {
+    IndexDir *dirs;
+    int dirCount, dirCap;
+    IndexFile *files;
+    int fileCount, fileCap;
+    int *freeFiles;        // Ids of removed files available for reuse
+    int freeCount, freeCap;
+    int *slots;            // Open-addressed (dir, name) -> file id + 1 table
+    size_t slotCap, slotUsed;
+    IndexName **names;     // Open-addressed basename -> interned record table
+    size_t nameCap, nameUsed;
+    IndexExt **exts;       // Open-addressed extension -> posting list table, never shrinks
+    size_t extCap, extUsed;
+    int foldCase;          // Extensions are matched case-insensitively
+    OrderedIndex bySize;
+    OrderedIndex byMtime;  // Keyed by mtime in nanoseconds
+    int *watchDirs;        // inotify watch descriptor -> dir id + 1
+    int watchCap;
+    int inotifyFd;
+    int liveFiles;
+    unsigned long generation;  // Bumped on every change applied to the index
+    char skipPath[PATH_MAX];   // The server's own output directory, never indexed
+    int stale;                 // Some directories are unwatched, so the index may miss files
+    int rebuilding;            // A crawl after lost events is running; the index is stale until it lands
+} fileIndex = { .inotifyFd = -1 };
+
+// Workers read the index while the event loop applies inotify changes to it
+static pthread_rwlock_t indexLock;
+
+// One change to the index, as recorded in the change journal
+typedef struct {
+    int id;             // File created or modified, -1 for a removal
+    uint32_t version;   // Its version after the change; the record is current while they match
+    char *removed;      // Path below the root of a removed file
+} ChangeRecord;
 
-#define MAX_MATCHING_FILES 1000 // Adjust based on expected server load and use case
+// Ring of the latest changes to the index. A w24sync token names a position in it, so the
+// records from there on are exactly what the holder of the token has not seen yet.
+struct {
+    ChangeRecord *ring;  // CHANGE_JOURNAL_SIZE records; seq lives at ring[seq % CHANGE_JOURNAL_SIZE]
+    uint64_t next;       // Seq of the next record
+    uint64_t epoch;      // New for every crawl from scratch, which invalidates all tokens
+    int enabled;         // Off while a crawl fills the index
+} changeJournal;
 
+// The index snapshot the server started from, mapped read-only. The ordered indexes use its
+// sorted arrays in place until their first merge, then the mapping is dropped.
 struct {
-    char *files[MAX_MATCHING_FILES];
-    int count;
-} matchingFiles;
+    void *map;
+    size_t size;
+    unsigned long generation;  // Index generation the snapshot on disk reflects
+} indexSnapshot;
 
-static FILE* tarFile;
+#define INDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                          IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
 
 typedef struct {
     char *name;
-    time_t mod_time;
+    time_t created;  // Birth time when the filesystem records one, otherwise mtime
 } DirEntry;
 
 
-// Global struct to store file search criteria and results
+// File search criteria and results
 struct fileInfo {
     char path[BUFFER_SIZE * 10]; // Increased size to hold file paths
     long size1;
     long size2;
     int found;
-} fileInfo;
+};
+
+// Wire protocol: every message is a FrameHeader followed by length payload bytes.
+// Multi-byte fields travel big-endian. Client/clientw24.c carries the same definitions.
+#define FRAME_MAGIC 0x5734              // "W4"
+#define FRAME_VERSION 1
+#define MAX_REQUEST_PAYLOAD 1024        // Longest command a client may send
+#define MAX_EXTENSIONS (MAX_REQUEST_PAYLOAD / 2)  // Each w24ft extension takes at least two bytes of a command
+#define FRAME_DATA_CHUNK (1024 * 1024)  // Archive bytes carried per DATA frame
+#define ARCHIVE_CHECK_CHUNK (1024 * 1024)  // Archive bytes covered by each CRC-32 in OP_CHECKSUMS
+#define MAX_INFLIGHT 32                 // Requests one connection may have running at once
+#define SEND_TIMEOUT_MS 30000           // Give up on a client that stops reading for this long
+#define OUT_BUFFER (64 * 1024)          // Reply bytes a connection coalesces before a write
+#define OUT_HIGH_WATERMARK (48 * 1024)  // Flush early once this much is buffered mid-response
+#define OUT_PENDING_MEMORY (1024 * 1024)  // Unsent reply bytes kept in memory before spilling to a file
+
+enum {
+    OP_REQUEST = 0x01,  // Client -> server: text command
+    OP_TEXT    = 0x81,  // Server -> client: reply text
+    OP_ERROR   = 0x82,  // Server -> client: error text
+    OP_ARCHIVE = 0x83,  // Server -> client: an archive follows, payload is ArchiveInfo
+    OP_DATA    = 0x84,  // Server -> client: next chunk of archive bytes
+    OP_CHECKSUMS = 0x85,  // Server -> client: CRC-32 of every checkChunk bytes of the archive
+};
+#define FLAG_END 0x0001 // Last frame of the response to this request id
+
+typedef struct {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint16_t reserved;
+    uint32_t id;        // Chosen by the client, echoed on every response frame
+    uint32_t length;    // Payload bytes following the header
+} FrameHeader;
+
+// Payload of OP_ARCHIVE
+typedef struct {
+    uint64_t size;      // Total bytes carried by the DATA frames that follow
+    char name[64];      // Suggested local file name, NUL-terminated
+    uint64_t rawSize;   // Size of the tar stream before compression
+    char codec[16];     // Codec and level, e.g. "gzip:6", NUL-terminated
+    uint64_t contentId; // Names these exact archive bytes; '-r <id>:<offset>' resumes them
+    uint64_t offset;    // Archive offset of the first DATA byte, nonzero when resuming
+    uint32_t checkChunk;  // Bytes covered by each CRC-32 of the OP_CHECKSUMS frame
+    uint32_t checkCount;  // CRC-32 values in it
+} ArchiveInfo;
+
+// Fills in a header in wire byte order
+static void frameHeaderInit(FrameHeader *h, uint8_t opcode, uint16_t flags, uint32_t id, uint32_t length) {
+    h->magic = htons(FRAME_MAGIC);
+    h->version = FRAME_VERSION;
+    h->opcode = opcode;
+    h->flags = htons(flags);
+    h->reserved = 0;
+    h->id = htonl(id);
+    h->length = htonl(length);
+}
+
+// Converts a received header to host byte order, returns -1 if it is not one of ours
+static int frameHeaderParse(FrameHeader *h) {
+    h->magic = ntohs(h->magic);
+    h->flags = ntohs(h->flags);
+    h->id = ntohl(h->id);
+    h->length = ntohl(h->length);
+    return (h->magic == FRAME_MAGIC && h->version == FRAME_VERSION) ? 0 : -1;
+}
+
+struct Conn;
+struct ArchiveCodec;
+
+// A single command being served, replies are tagged with its id
+typedef struct Request {
+    struct Conn *conn;
+    uint32_t id;
+    Arena *arena;               // Scratch memory of the worker serving it, reset afterwards
+    const struct ArchiveCodec *codec;  // Archive format from '-z', gzip by default
+    int level;
+    int part;                   // '-p': archive without the end-of-archive blocks
+    uint64_t resumeId;          // '-r id:offset': content id of a partly received archive, or 0
+    uint64_t resumeOffset;
+    int stat;                   // StatCommand it is counted under
+    int failed;                 // Answered with an ERROR frame
+    uint64_t sendMicros;        // Time spent writing its replies
+    uint64_t bytesSent;         // Reply payload bytes
+    struct Request *next;       // Link in the worker queue
+    char command[];             // NUL-terminated command text
+} Request;
+
+// Lifecycle of a client connection in the event loop
+typedef enum {
+    CONN_READING,   // Accepting new requests
+    CONN_DRAINING,  // Client quit or hung up, closes once in-flight requests finish
+} ConnState;
+
+// Kinds of output left for the event loop once a client's socket is full
+typedef enum {
+    PENDING_BYTES,    // Copied into data
+    PENDING_SPILL,    // A range of the connection's spill file
+    PENDING_ARCHIVE,  // The rest of an archive, sent as DATA frames
+} PendingKind;
+
+typedef struct PendingOut {
+    struct PendingOut *next;
+    PendingKind kind;
+    int fd;                 // Spill file, or a descriptor of the archive owned by this entry
+    off_t offset, end;      // What is left of the file range
+    off_t frameLeft;        // Archive bytes left in the current DATA frame
+    uint32_t id;            // Request the DATA frames belong to
+    size_t headSent;        // Bytes of head already written, sizeof(head) once done
+    FrameHeader head;       // Header of the current DATA frame
+    size_t len, sent;       // Size of data and how much of it went out
+    unsigned char data[];
+} PendingOut;
+
+// Per-connection state, about 1 KiB so idle clients stay cheap.
+// Requests from one connection run concurrently and reply out of order, tagged by id.
+typedef struct Conn {
+    int fd;
+    pthread_mutex_t lock;       // Guards the fields below
+    pthread_mutex_t writeLock;  // Keeps frames from concurrent requests whole on the wire
+    unsigned char *out;         // Frames not yet written, OUT_BUFFER bytes; guarded by writeLock
+    size_t outLen;
+    size_t outLast;             // Offset of the last buffered frame, for merging text replies
+    PendingOut *pending, *pendingTail;  // Output the socket has not taken yet; guarded by writeLock
+    size_t pendingMemory;       // Bytes of data held by pending
+    int spillFd;                // Unlinked file for pending bytes past OUT_PENDING_MEMORY, -1 until needed
+    off_t spillSize;
+    int outArmed;               // Registered with writerEpollFd for one EPOLLOUT; guarded by writeLock
+    ConnState state;
+    int inflight;               // Requests queued or running
+    int armed;                  // Registered for one epoll event that has not fired yet
+    int writing;                // Output is pending: no new requests start and the connection stays open
+    size_t inLen;
+    unsigned char in[sizeof(FrameHeader) + MAX_REQUEST_PAYLOAD];  // Received, not yet dispatched
+} Conn;
+
+// Requests waiting for a worker thread
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Request *head, *tail;
+} jobQueue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL };
+
+static int epollFd;
+static int writerEpollFd;  // Connections waiting for their socket to drain; polled through epollFd
+
+// Live load, reported to the primary so it can place new connections
+static atomic_int activeRequests;   // Running on a worker
+static atomic_int queuedRequests;   // Waiting for a worker
+static atomic_int openConnections;
+
+// Metrics for 'stats' and the optional Prometheus endpoint (-P). Everything is a relaxed
+// atomic, so recording never takes a lock.
+typedef enum {
+    STAT_DIRLIST, STAT_W24FN, STAT_W24FZ, STAT_W24FT, STAT_W24FDB, STAT_W24FDA, STAT_W24SYNC, STAT_OTHER,
+    STAT_COMMANDS
+} StatCommand;
+static const char *statCommandNames[STAT_COMMANDS] = {
+    "dirlist", "w24fn", "w24fz", "w24ft", "w24fdb", "w24fda", "w24sync", "other"
+};
+
+typedef enum {
+    PHASE_TOTAL,     // Dequeued by a worker to last reply frame
+    PHASE_WALK,      // Reading directories: dirlist, and w24fn when the index is stale
+    PHASE_FILTER,    // Selecting matches from the index under its read lock
+    PHASE_COMPRESS,  // Building an archive, only on cache misses
+    PHASE_SEND,      // Writing replies; what a slow client leaves unread goes to the event loop
+    STAT_PHASES
+} StatPhase;
+static const char *statPhaseNames[STAT_PHASES] = { "total", "walk", "filter", "compress", "send" };
+
+// HDR-style latency histogram in microseconds: exact below STAT_SUB, then STAT_SUB linear
+// buckets per power of two, so quantiles are within about 3%. Values past 2^36 us are clamped.
+#define STAT_SUB_BITS 5
+#define STAT_SUB (1 << STAT_SUB_BITS)
+#define STAT_MAX_BITS 36
+#define STAT_BUCKETS ((STAT_MAX_BITS - STAT_SUB_BITS + 1) * STAT_SUB)
+
+typedef struct {
+    atomic_ullong counts[STAT_BUCKETS];
+    atomic_ullong count, sum, max;
+} StatHistogram;
+
+static struct {
+    atomic_ullong requests[STAT_COMMANDS];
+    atomic_ullong errors[STAT_COMMANDS];
+    atomic_ullong bytes[STAT_COMMANDS];       // Reply payload bytes
+    atomic_ullong archiveRawBytes;            // Tar bytes fed to the compressor
+    atomic_ullong archiveBytes;               // Compressed bytes written to the cache
+    atomic_ullong archivesBuilt;
+    StatHistogram latency[STAT_COMMANDS][STAT_PHASES];
+} stats;
+
+static uint64_t statsClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int statBucket(uint64_t v) {
+    if (v >> STAT_MAX_BITS) v = (1ULL << STAT_MAX_BITS) - 1;
+    if (v < STAT_SUB) return v;
+    int shift = 63 - __builtin_clzll(v) - STAT_SUB_BITS;
+    return (shift + 1) * STAT_SUB + (int)((v >> shift) - STAT_SUB);
+}
+
+// Highest value that lands in bucket b
+static uint64_t statBucketTop(int b) {
+    if (b < STAT_SUB) return b;
+    int shift = b / STAT_SUB - 1;
+    return ((uint64_t)(STAT_SUB + b % STAT_SUB + 1) << shift) - 1;
+}
+
+static void statRecord(StatCommand cmd, StatPhase phase, uint64_t micros) {
+    StatHistogram *h = &stats.latency[cmd][phase];
+    atomic_fetch_add_explicit(&h->counts[statBucket(micros)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, micros, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (micros > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, micros,
+                                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+// Records the phase of req that started at the statsClock() reading since
+static void statPhase(const Request *req, StatPhase phase, uint64_t since) {
+    statRecord(req->stat, phase, statsClock() - since);
+}
+
+// Quantile q of a histogram that may be updated meanwhile; good enough for monitoring
+static uint64_t statQuantile(StatHistogram *h, double q) {
+    unsigned long long total = 0, seen = 0;
+    unsigned long long counts[STAT_BUCKETS];
+    for (int i = 0; i < STAT_BUCKETS; i++)
+        total += counts[i] = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    if (total == 0) return 0;
+    unsigned long long rank = (unsigned long long)(q * total + 0.999999);
+    if (rank == 0) rank = 1;
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) return statBucketTop(i) < max ? statBucketTop(i) : max;
+    }
+    return max;
+}
+
+// Counts a finished request; start is the statsClock() reading when a worker took it
+static void statRequestDone(const Request *req, uint64_t start) {
+    statRecord(req->stat, PHASE_TOTAL, statsClock() - start);
+    statRecord(req->stat, PHASE_SEND, req->sendMicros);
+    atomic_fetch_add_explicit(&stats.requests[req->stat], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.bytes[req->stat], req->bytesSent, memory_order_relaxed);
+    if (req->failed) atomic_fetch_add_explicit(&stats.errors[req->stat], 1, memory_order_relaxed);
+}
+
+static StatCommand statCommandOf(const char *command) {
+    static const char *prefixes[] = { "dirlist ", "w24fn ", "w24fz ", "w24ft ", "w24fdb ", "w24fda ", "w24sync" };
+    for (int i = 0; i < STAT_OTHER; i++)
+        if (strncmp(command, prefixes[i], strlen(prefixes[i])) == 0) return i;
+    return STAT_OTHER;
+}
+
+// Messages on the SOCK_SEQPACKET control link between primary and mirror.
+// Both ends are on the same host, so fields are in native byte order.
+enum {
+    CTL_PING = 1,   // Primary -> mirror, answered with a PONG
+    CTL_PONG,       // Mirror -> primary, carries the load counters
+    CTL_HANDOFF,    // Primary -> mirror, carries an accepted client socket as SCM_RIGHTS
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t active;    // PONG: requests running
+    uint32_t queued;    // PONG: requests waiting for a worker
+    uint32_t conns;     // PONG: open client connections
+} ControlMsg;
+
+// A mirror as seen by the primary
+typedef struct {
+    int port;          // Client port; also names the mirror's control socket
+    int fd;            // Control link, -1 while disconnected
+    int healthy;       // Answered a ping on the current link; only then in rotation
+    int missed;        // Pings sent since the last pong
+    int load;          // Active plus queued requests at the last pong
+    int handedOff;     // Connections passed since the last pong
+} Mirror;
+
+static Mirror mirrors[MAX_MIRRORS];
+static int mirrorCount;
+static int localAccepted;     // Connections kept by the primary since the last health tick
+static int dispatchCursor;    // Rotates the scan start so equal loads take turns
+static int healthTimerFd = -1;
+
+// Mirror mode: listening control socket and the primaries linked to it
+static int controlFd = -1;
+static int controlPeers[MAX_CONTROL_PEERS];
 
 
 // Error handling function
@@ -56,10 +536,356 @@ void error(const char *msg) {
     exit(1);
 }
 
-// Helper function to send data through the socket
-void sendData(int client_sock_fd, const char* data) {
-    if (write(client_sock_fd, data, strlen(data)) < 0) 
+// Returns size bytes, 16-byte aligned, valid until the arena is reset; NULL when out of memory
+static void *arenaAlloc(Arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    ArenaChunk *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunkSize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(ArenaChunk) + chunkSize);
+        if (!chunk) return NULL;
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->size = chunkSize;
+        arena->head = chunk;
+    }
+    arena->last = chunk->data + chunk->used;
+    chunk->used += size;
+    return arena->last;
+}
+
+// Resizes an arena allocation, in place when it is the most recent one and fits
+static void *arenaGrow(Arena *arena, void *old, size_t oldSize, size_t newSize) {
+    ArenaChunk *chunk = arena->head;
+    if (old && old == arena->last && (char *)old + newSize <= chunk->data + chunk->size) {
+        chunk->used = (char *)old - chunk->data + ((newSize + 15) & ~(size_t)15);
+        return old;
+    }
+    void *grown = arenaAlloc(arena, newSize);
+    if (grown && old) memcpy(grown, old, oldSize);
+    return grown;
+}
+
+// Releases everything allocated since the last reset, keeping the oldest chunk for reuse
+static void arenaReset(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk && chunk->next) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    if (chunk) chunk->used = 0;
+    arena->head = chunk;
+    arena->last = NULL;
+}
+
+// Appends a copy of the first len bytes of s; returns its index or -1 when out of memory
+static long stringListAddLen(StringList *list, const char *s, size_t len) {
+    if (list->count == list->offsetCap) {
+        size_t cap = list->offsetCap ? list->offsetCap * 2 : 64;
+        uint32_t *grown = arenaGrow(list->arena, list->offsets, list->offsetCap * sizeof(uint32_t), cap * sizeof(uint32_t));
+        if (!grown) return -1;
+        list->offsets = grown;
+        list->offsetCap = cap;
+    }
+    if (list->len + len + 1 > list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 4096;
+        while (cap < list->len + len + 1) cap *= 2;
+        if (cap > UINT32_MAX) return -1;
+        char *grown = arenaGrow(list->arena, list->bytes, list->len, cap);
+        if (!grown) return -1;
+        list->bytes = grown;
+        list->cap = cap;
+    }
+    list->offsets[list->count] = list->len;
+    memcpy(list->bytes + list->len, s, len);
+    list->bytes[list->len + len] = '\0';
+    list->len += len + 1;
+    return list->count++;
+}
+
+static long stringListAdd(StringList *list, const char *s) {
+    return stringListAddLen(list, s, strlen(s));
+}
+
+// Pointers are stable once the list stops growing
+static const char *stringListGet(const StringList *list, size_t i) {
+    return list->bytes + list->offsets[i];
+}
+
+// Writes all of buf, retrying after short writes and signals
+static int writeAll(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sends the iovecs until done or until a non-blocking socket is full, retrying after short writes
+// and signals; flags such as MSG_MORE pass through. Advances *v past what was sent and returns the
+// number of iovecs left, or -1 on error.
+static int sendvSome(int fd, struct iovec **v, int iovcnt, int flags) {
+    while (iovcnt > 0) {
+        struct msghdr msg = { .msg_iov = *v, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(fd, &msg, flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN ? iovcnt : -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= (*v)->iov_len) {
+            n -= (*v)->iov_len;
+            (*v)++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            (*v)->iov_base = (char *)(*v)->iov_base + n;
+            (*v)->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Sends every iovec in full on a blocking socket
+static int sendvAll(int fd, struct iovec *v, int iovcnt, int flags) {
+    return sendvSome(fd, &v, iovcnt, flags) == 0 ? 0 : -1;
+}
+
+static void pendingFree(PendingOut *p) {
+    if (p->kind == PENDING_ARCHIVE) close(p->fd);
+    free(p);
+}
+
+// Drops all pending output after a failed write. Called with writeLock held.
+static void connDiscard(Conn *conn) {
+    while (conn->pending) {
+        PendingOut *p = conn->pending;
+        conn->pending = p->next;
+        pendingFree(p);
+    }
+    conn->pendingTail = NULL;
+    conn->pendingMemory = 0;
+    if (conn->spillFd >= 0 && ftruncate(conn->spillFd, 0) == 0) conn->spillSize = 0;
+}
+
+// Registers the connection for one EPOLLOUT, so the event loop sends what is pending once the
+// client reads again. Called with writeLock held.
+static int connArmWriter(Conn *conn) {
+    if (conn->outArmed) return 0;
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.ptr = conn };
+    if (epoll_ctl(writerEpollFd, EPOLL_CTL_MOD, conn->fd, &ev) < 0 &&
+        (errno != ENOENT || epoll_ctl(writerEpollFd, EPOLL_CTL_ADD, conn->fd, &ev) < 0))
+        return -1;
+    conn->outArmed = 1;
+    pthread_mutex_lock(&conn->lock);
+    conn->writing = 1;
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+}
+
+static void connAppend(Conn *conn, PendingOut *p) {
+    p->next = NULL;
+    if (conn->pendingTail) conn->pendingTail->next = p;
+    else conn->pending = p;
+    conn->pendingTail = p;
+}
+
+// Leaves output the socket did not take to the event loop. Bytes past OUT_PENDING_MEMORY go to
+// an unlinked spill file, so a client that stops reading costs disk, not memory.
+// Called with writeLock held.
+static int connQueue(Conn *conn, struct iovec *v, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += v[i].iov_len;
+    if (conn->pendingMemory + total <= OUT_PENDING_MEMORY) {
+        PendingOut *p = malloc(sizeof(PendingOut) + total);
+        if (!p) return -1;
+        p->kind = PENDING_BYTES;
+        p->len = total;
+        p->sent = 0;
+        size_t at = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(p->data + at, v[i].iov_base, v[i].iov_len);
+            at += v[i].iov_len;
+        }
+        conn->pendingMemory += total;
+        connAppend(conn, p);
+        return connArmWriter(conn);
+    }
+
+    if (conn->spillFd < 0 && (conn->spillFd = open(fileIndex.skipPath, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0)
+        return -1;
+    off_t start = conn->spillSize;
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(conn->spillFd, v, iovcnt, conn->spillSize);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        conn->spillSize += n;
+        while (iovcnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    PendingOut *tail = conn->pendingTail;
+    if (tail && tail->kind == PENDING_SPILL && tail->end == start) {
+        tail->end = conn->spillSize;
+        return 0;
+    }
+    PendingOut *p = malloc(sizeof(PendingOut));
+    if (!p) return -1;
+    p->kind = PENDING_SPILL;
+    p->fd = conn->spillFd;
+    p->offset = start;
+    p->end = conn->spillSize;
+    connAppend(conn, p);
+    return connArmWriter(conn);
+}
+
+// Leaves the rest of an archive to the event loop, from offset to end of which the current
+// DATA frame still carries frameLeft bytes. Called with writeLock held.
+static int connQueueArchive(Conn *conn, int fd, off_t offset, off_t end, off_t frameLeft, uint32_t id) {
+    PendingOut *p = malloc(sizeof(PendingOut));
+    if (!p) return -1;
+    if ((p->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        free(p);
+        return -1;
+    }
+    p->kind = PENDING_ARCHIVE;
+    p->offset = offset;
+    p->end = end;
+    p->frameLeft = frameLeft;
+    p->id = id;
+    p->headSent = sizeof(p->head);
+    connAppend(conn, p);
+    return connArmWriter(conn);
+}
+
+// Sends pending output until it is all gone or the socket is full.
+// Returns 1 if some is left, 0 once everything went and -1 on error. Called with writeLock held.
+static int connDrain(Conn *conn) {
+    while (conn->pending) {
+        PendingOut *p = conn->pending;
+        ssize_t n;
+        if (p->kind == PENDING_BYTES && p->sent < p->len) {
+            n = send(conn->fd, p->data + p->sent, p->len - p->sent, p->next ? MSG_MORE : 0);
+            if (n > 0) p->sent += n;
+        } else if (p->kind == PENDING_ARCHIVE && p->headSent < sizeof(p->head)) {
+            n = send(conn->fd, (char *)&p->head + p->headSent, sizeof(p->head) - p->headSent, MSG_MORE);
+            if (n > 0) p->headSent += n;
+        } else if (p->kind == PENDING_ARCHIVE && p->frameLeft == 0 && p->offset < p->end) {
+            // Each chunk is one frame, as when the worker sends it
+            p->frameLeft = p->end - p->offset > FRAME_DATA_CHUNK ? FRAME_DATA_CHUNK : p->end - p->offset;
+            frameHeaderInit(&p->head, OP_DATA, 0, p->id, p->frameLeft);
+            p->headSent = 0;
+            continue;
+        } else if (p->kind != PENDING_BYTES && p->offset < p->end) {
+            n = sendfile(conn->fd, p->fd, &p->offset, p->kind == PENDING_ARCHIVE ? p->frameLeft : p->end - p->offset);
+            if (n > 0 && p->kind == PENDING_ARCHIVE) p->frameLeft -= n;
+            if (n == 0) {
+                // The file is shorter than it was; the client cannot resynchronise
+                errno = EIO;
+                n = -1;
+            }
+        } else {
+            conn->pending = p->next;
+            if (!conn->pending) conn->pendingTail = NULL;
+            if (p->kind == PENDING_BYTES) conn->pendingMemory -= p->len;
+            pendingFree(p);
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN ? 1 : -1;
+        }
+    }
+    if (conn->spillFd >= 0 && ftruncate(conn->spillFd, 0) == 0) conn->spillSize = 0;
+    return 0;
+}
+
+// Writes the buffered frames followed by up to two more iovecs in one sendmsg, never waiting
+// for the client: whatever the socket does not take, and everything while earlier output is
+// still pending, is left to the event loop. Called with writeLock held; MSG_MORE tells the
+// kernel the response goes on.
+static int connFlush(Conn *conn, const void *head, size_t headLen, const void *tail, size_t tailLen, int flags) {
+    struct iovec iov[3], *v = iov;
+    int n = 0;
+    if (conn->outLen > 0) iov[n++] = (struct iovec){ conn->out, conn->outLen };
+    if (headLen > 0) iov[n++] = (struct iovec){ (void *)head, headLen };
+    if (tailLen > 0) iov[n++] = (struct iovec){ (void *)tail, tailLen };
+    conn->outLen = 0;
+    conn->outLast = SIZE_MAX;
+    if (n == 0) return 0;
+    if (!conn->pending) n = sendvSome(conn->fd, &v, n, flags);
+    if (n > 0 && connQueue(conn, v, n) < 0) {
+        connDiscard(conn);
+        n = -1;
+    }
+    if (n < 0) {
         perror("ERROR writing to socket");
+        shutdown(conn->fd, SHUT_RDWR);
+        return -1;
+    }
+    return 0;
+}
+
+// Queues one frame on the connection. Text and error lines of one request merge into a single
+// frame while they sit in the buffer. Frames go out when the buffer reaches OUT_HIGH_WATERMARK,
+// when a response ends or when a payload does not fit, so a long listing costs a few writes
+// instead of one per line. Returns -1 if the connection failed.
+int sendFrame(Request *req, uint8_t opcode, uint16_t flags, const void *payload, uint32_t len) {
+    Conn *conn = req->conn;
+    FrameHeader header;
+    frameHeaderInit(&header, opcode, flags, req->id, len);
+    uint64_t start = statsClock();
+
+    pthread_mutex_lock(&conn->writeLock);
+    if (!conn->out && (conn->out = malloc(OUT_BUFFER)) != NULL) conn->outLast = SIZE_MAX;
+    int rc = 0;
+    if (!conn->out || conn->outLen + sizeof(header) + len > OUT_BUFFER) {
+        // Too big to copy: the buffered frames and this one leave together
+        rc = connFlush(conn, &header, sizeof(header), payload, len, (flags & FLAG_END) ? 0 : MSG_MORE);
+    } else {
+        FrameHeader last;  // Copied out, buffered frames are not aligned
+        if (conn->outLast != SIZE_MAX) memcpy(&last, conn->out + conn->outLast, sizeof(last));
+        if (conn->outLast != SIZE_MAX && last.opcode == opcode && last.flags == 0 && last.id == header.id &&
+            (opcode == OP_TEXT || opcode == OP_ERROR) && flags == 0) {
+            last.length = htonl(ntohl(last.length) + len);
+            memcpy(conn->out + conn->outLast, &last, sizeof(last));
+        } else {
+            conn->outLast = conn->outLen;
+            memcpy(conn->out + conn->outLen, &header, sizeof(header));
+            conn->outLen += sizeof(header);
+        }
+        if (len > 0) memcpy(conn->out + conn->outLen, payload, len);
+        conn->outLen += len;
+        if (flags & FLAG_END) rc = connFlush(conn, NULL, 0, NULL, 0, 0);
+        else if (conn->outLen >= OUT_HIGH_WATERMARK) rc = connFlush(conn, NULL, 0, NULL, 0, MSG_MORE);
+    }
+    pthread_mutex_unlock(&conn->writeLock);
+    req->sendMicros += statsClock() - start;
+    req->bytesSent += len;
+    return rc;
+}
+
+// Helper function to send data through the socket
+void sendData(Request *req, const char* data) {
+    sendFrame(req, OP_TEXT, 0, data, strlen(data));
+}
+
+// Reports a failure for the request; the client prints it like any other reply
+void sendError(Request *req, const char* message) {
+    req->failed = 1;
+    sendFrame(req, OP_ERROR, 0, message, strlen(message));
 }
 
 // Comparator function for alphabetical sorting
@@ -69,587 +895,3947 @@ int alphaSort(const void* a, const void* b) {
     return strcasecmp(dirA, dirB);
 }
 
+// Case-sensitive counterpart of alphaSort, for extensions
+int stringSort(const void* a, const void* b) {
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
 // Comparator for sorting directories by creation time
 int timeSort(const void *a, const void *b) {
     DirEntry *dirA = (DirEntry *)a;
     DirEntry *dirB = (DirEntry *)b;
-    return (dirA->mod_time > dirB->mod_time) - (dirA->mod_time < dirB->mod_time);
+    return (dirA->created > dirB->created) - (dirA->created < dirB->created);
 }
 
-void listDirectoriesByCreationTime(int client_sock_fd) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat statbuf;
-    DirEntry directories[MAX_DIRS];
-    int dirCount = 0;
-    char buffer[BUFFER_SIZE * 2], path[BUFFER_SIZE];
-    char timeBuff[64];
+// Hash of a (directory, basename) pair for the index lookup table
+static size_t indexHash(int dir, const char *name) {
+    size_t h = 14695981039346656037ULL ^ (size_t)dir;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
 
-    char *homeDir = getenv("HOME");
-    if ((dir = opendir(homeDir)) == NULL) {
-        sendData(client_sock_fd, "Failed to open directory.\n");
-        return;
+// Grows the lookup table and re-inserts every live file
+static void indexRehash(size_t newCap) {
+    free(fileIndex.slots);
+    fileIndex.slots = calloc(newCap, sizeof(int));
+    if (!fileIndex.slots) error("ERROR allocating index");
+    fileIndex.slotCap = newCap;
+    fileIndex.slotUsed = 0;
+    for (int id = 0; id < fileIndex.fileCount; id++) {
+        IndexFile *f = &fileIndex.files[id];
+        if (!f->live) continue;
+        size_t i = indexHash(f->dir, f->name) & (newCap - 1);
+        while (fileIndex.slots[i]) i = (i + 1) & (newCap - 1);
+        fileIndex.slots[i] = id + 1;
+        fileIndex.slotUsed++;
     }
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-            snprintf(path, sizeof(path), "%s/%s", homeDir, entry->d_name);  // Generate absolute path
-            if (stat(path, &statbuf) == -1) {
-                perror("stat");
-                continue;
-            }
-            directories[dirCount].name = strdup(entry->d_name);
-            directories[dirCount].mod_time = statbuf.st_mtime;
-            dirCount++;
-            if (dirCount >= MAX_DIRS) break;
+// Returns the lookup table slot holding (dir, name), or the empty slot where it belongs
+static size_t indexSlot(int dir, const char *name) {
+    size_t mask = fileIndex.slotCap - 1;
+    size_t i = indexHash(dir, name) & mask;
+    while (fileIndex.slots[i]) {
+        IndexFile *f = &fileIndex.files[fileIndex.slots[i] - 1];
+        if (f->dir == dir && strcmp(f->name, name) == 0) break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Looks up a file by containing directory and basename, returns -1 if it is not indexed
+static int indexFindFile(int dir, const char *name) {
+    if (fileIndex.slotCap == 0) return -1;
+    return fileIndex.slots[indexSlot(dir, name)] - 1;
+}
+
+static int idListPush(IdList *list, int id) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        int *grown = realloc(list->ids, cap * sizeof(int));
+        if (!grown) return -1;
+        list->ids = grown;
+        list->cap = cap;
+    }
+    list->ids[list->count++] = id;
+    return 0;
+}
+
+static int orderedCompare(const void *a, const void *b) {
+    const OrderedEntry *x = a, *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int orderedCurrent(const OrderedEntry *e) {
+    const IndexFile *f = &fileIndex.files[e->id];
+    return f->live && f->version == e->version;
+}
+
+static void indexSnapshotUnmap(void) {
+    if (indexSnapshot.map) munmap(indexSnapshot.map, indexSnapshot.size);
+    indexSnapshot.map = NULL;
+}
+
+// Sorts the delta into the main array, dropping superseded entries on the way
+static void orderedMerge(OrderedIndex *oi) {
+    qsort(oi->delta, oi->deltaCount, sizeof(OrderedEntry), orderedCompare);
+    size_t cap = oi->count + oi->deltaCount;
+    OrderedEntry *merged = malloc((cap ? cap : 1) * sizeof(OrderedEntry));
+    if (!merged) error("ERROR allocating index");
+    size_t n = 0, i = 0, j = 0;
+    while (i < oi->count || j < oi->deltaCount) {
+        const OrderedEntry *e;
+        if (j == oi->deltaCount || (i < oi->count && orderedCompare(&oi->sorted[i], &oi->delta[j]) <= 0))
+            e = &oi->sorted[i++];
+        else
+            e = &oi->delta[j++];
+        if (orderedCurrent(e)) merged[n++] = *e;
+    }
+    if (!oi->mapped) free(oi->sorted);
+    oi->mapped = 0;
+    if (!fileIndex.bySize.mapped && !fileIndex.byMtime.mapped) indexSnapshotUnmap();
+    oi->sorted = merged;
+    oi->count = n;
+    oi->cap = cap;
+    oi->deltaCount = 0;
+    oi->stale = 0;
+}
+
+// Merges once the delta or the superseded entries would make range scans noticeably slower
+static void orderedMaybeMerge(OrderedIndex *oi) {
+    size_t limit = oi->count / 16 > 256 ? oi->count / 16 : 256;
+    if (oi->deltaCount > limit || oi->stale > oi->count / 2 + 256) orderedMerge(oi);
+}
+
+static void orderedInsert(OrderedIndex *oi, int64_t key, int id, uint32_t version) {
+    if (oi->deltaCount == oi->deltaCap) {
+        oi->deltaCap = oi->deltaCap ? oi->deltaCap * 2 : 256;
+        oi->delta = realloc(oi->delta, oi->deltaCap * sizeof(OrderedEntry));
+        if (!oi->delta) error("ERROR allocating index");
+    }
+    oi->delta[oi->deltaCount++] = (OrderedEntry){ key, id, version };
+    orderedMaybeMerge(oi);
+}
+
+// Records that one entry was superseded by a version change or a removal
+static void orderedRetire(OrderedIndex *oi) {
+    oi->stale++;
+    orderedMaybeMerge(oi);
+}
+
+static void orderedReset(OrderedIndex *oi) {
+    if (!oi->mapped) free(oi->sorted);
+    free(oi->delta);
+    memset(oi, 0, sizeof(*oi));
+}
+
+// Appends the ids of current entries with lo <= key <= hi: a binary search, then a
+// contiguous scan of the matches, plus a pass over the small delta
+static int orderedRange(const OrderedIndex *oi, int64_t lo, int64_t hi, IdList *out) {
+    size_t first = 0, last = oi->count;
+    while (first < last) {
+        size_t mid = first + (last - first) / 2;
+        if (oi->sorted[mid].key < lo) first = mid + 1;
+        else last = mid;
+    }
+    for (size_t i = first; i < oi->count && oi->sorted[i].key <= hi; i++)
+        if (orderedCurrent(&oi->sorted[i]) && idListPush(out, oi->sorted[i].id) < 0) return -1;
+    for (size_t i = 0; i < oi->deltaCount; i++) {
+        const OrderedEntry *e = &oi->delta[i];
+        if (e->key >= lo && e->key <= hi && orderedCurrent(e) && idListPush(out, e->id) < 0) return -1;
+    }
+    return 0;
+}
+
+// Builds the absolute path of an indexed file
+static void indexFilePath(const IndexFile *f, char *buf, size_t len) {
+    snprintf(buf, len, "%s/%s", fileIndex.dirs[f->dir].path, f->name);
+}
+
+static uint32_t indexNameHash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Returns the name table slot holding name, or the empty slot where it belongs
+static size_t indexNameSlot(const char *name, uint32_t hash) {
+    size_t mask = fileIndex.nameCap - 1;
+    size_t i = hash & mask;
+    while (fileIndex.names[i] && (fileIndex.names[i]->hash != hash || strcmp(fileIndex.names[i]->str, name) != 0))
+        i = (i + 1) & mask;
+    return i;
+}
+
+// Looks up the interned record of a basename, NULL if no indexed file has it
+static IndexName *indexFindName(const char *name) {
+    if (fileIndex.nameCap == 0) return NULL;
+    return fileIndex.names[indexNameSlot(name, indexNameHash(name))];
+}
+
+// Returns the interned record of name, creating it if needed
+static IndexName *indexIntern(const char *name) {
+    if ((fileIndex.nameUsed + 1) * 2 > fileIndex.nameCap) {
+        size_t oldCap = fileIndex.nameCap;
+        IndexName **old = fileIndex.names;
+        fileIndex.nameCap = oldCap ? oldCap * 2 : 1024;
+        fileIndex.names = calloc(fileIndex.nameCap, sizeof(IndexName *));
+        if (!fileIndex.names) error("ERROR allocating index");
+        for (size_t k = 0; k < oldCap; k++) {
+            if (!old[k]) continue;
+            size_t i = old[k]->hash & (fileIndex.nameCap - 1);
+            while (fileIndex.names[i]) i = (i + 1) & (fileIndex.nameCap - 1);
+            fileIndex.names[i] = old[k];
+        }
+        free(old);
+    }
+    uint32_t hash = indexNameHash(name);
+    size_t i = indexNameSlot(name, hash);
+    if (!fileIndex.names[i]) {
+        size_t len = strlen(name);
+        IndexName *n = malloc(sizeof(IndexName) + len + 1);
+        if (!n) error("ERROR allocating index");
+        n->hash = hash;
+        n->refs = 0;
+        n->firstFile = -1;
+        memcpy(n->str, name, len + 1);
+        fileIndex.names[i] = n;
+        fileIndex.nameUsed++;
+    }
+    return fileIndex.names[i];
+}
+
+// Drops a file's reference on its name; the last one frees the record
+static void indexRelease(IndexName *n) {
+    if (--n->refs > 0) return;
+    size_t mask = fileIndex.nameCap - 1;
+    size_t i = indexNameSlot(n->str, n->hash);
+
+    // Backward-shift deletion for linear probing
+    fileIndex.names[i] = NULL;
+    for (size_t j = (i + 1) & mask; fileIndex.names[j]; j = (j + 1) & mask) {
+        size_t home = fileIndex.names[j]->hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            fileIndex.names[i] = fileIndex.names[j];
+            fileIndex.names[j] = NULL;
+            i = j;
+        }
+    }
+    fileIndex.nameUsed--;
+    free(n);
+}
+
+// Finds the extension of name, the part after the last '.', and copies it to key,
+// lowercased when fold is set. Returns its length, or -1 if name has no '.'.
+// Sixteen bytes are examined per step with SSE2; aligned loads never cross into
+// an unmapped page, so reading past the terminator is safe.
+static int extensionOf(const char *name, char *key, size_t keySize, int fold) {
+    const char *dot = NULL, *end;
+#ifdef __SSE2__
+    const __m128i dots = _mm_set1_epi8('.'), zero = _mm_setzero_si128();
+    const char *block = (const char *)((uintptr_t)name & ~(uintptr_t)15);
+    unsigned skip = name - block;
+    while (1) {
+        __m128i v = _mm_load_si128((const __m128i *)block);
+        unsigned dotMask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, dots)) >> skip << skip;
+        unsigned nulMask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) >> skip << skip;
+        if (nulMask) {
+            unsigned nul = __builtin_ctz(nulMask);
+            dotMask &= (1u << nul) - 1;
+            if (dotMask) dot = block + 31 - __builtin_clz(dotMask);
+            end = block + nul;
+            break;
+        }
+        if (dotMask) dot = block + 31 - __builtin_clz(dotMask);
+        block += 16;
+        skip = 0;
+    }
+#else
+    for (end = name; *end; end++)
+        if (*end == '.') dot = end;
+#endif
+    if (!dot) return -1;
+    size_t len = end - dot - 1;
+    if (len >= keySize) return -1;
+    size_t i = 0;
+#ifdef __SSE2__
+    if (fold) {
+        // Add 0x20 to every byte in 'A'..'Z'; signed compares work because both bounds are ASCII
+        const __m128i below = _mm_set1_epi8('A' - 1), above = _mm_set1_epi8('Z' + 1), bit = _mm_set1_epi8(0x20);
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(dot + 1 + i));
+            __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, below), _mm_cmplt_epi8(v, above));
+            _mm_storeu_si128((__m128i *)(key + i), _mm_add_epi8(v, _mm_and_si128(upper, bit)));
+        }
+    }
+#endif
+    for (; i < len; i++) key[i] = fold ? tolower((unsigned char)dot[1 + i]) : dot[1 + i];
+    key[len] = '\0';
+    return (int)len;
+}
+
+// Returns the posting list of an extension key, creating it when create is set
+static IndexExt *indexFindExt(const char *key, int create) {
+    if (create && (fileIndex.extUsed + 1) * 2 > fileIndex.extCap) {
+        size_t oldCap = fileIndex.extCap;
+        IndexExt **old = fileIndex.exts;
+        fileIndex.extCap = oldCap ? oldCap * 2 : 256;
+        fileIndex.exts = calloc(fileIndex.extCap, sizeof(IndexExt *));
+        if (!fileIndex.exts) error("ERROR allocating index");
+        for (size_t k = 0; k < oldCap; k++) {
+            if (!old[k]) continue;
+            size_t i = old[k]->hash & (fileIndex.extCap - 1);
+            while (fileIndex.exts[i]) i = (i + 1) & (fileIndex.extCap - 1);
+            fileIndex.exts[i] = old[k];
         }
+        free(old);
+    }
+    if (fileIndex.extCap == 0) return NULL;
+    uint32_t hash = indexNameHash(key);
+    size_t mask = fileIndex.extCap - 1;
+    size_t i = hash & mask;
+    while (fileIndex.exts[i] && (fileIndex.exts[i]->hash != hash || strcmp(fileIndex.exts[i]->str, key) != 0))
+        i = (i + 1) & mask;
+    if (!fileIndex.exts[i] && create) {
+        size_t len = strlen(key);
+        IndexExt *e = calloc(1, sizeof(IndexExt) + len + 1);
+        if (!e) error("ERROR allocating index");
+        e->hash = hash;
+        memcpy(e->str, key, len + 1);
+        fileIndex.exts[i] = e;
+        fileIndex.extUsed++;
+    }
+    return fileIndex.exts[i];
+}
+
+// Adds a newly indexed file to the posting list of its extension
+static void indexLinkExt(int id) {
+    IndexFile *f = &fileIndex.files[id];
+    char key[NAME_MAX + 1];
+    f->extEntry = NULL;
+    if (extensionOf(f->name, key, sizeof(key), fileIndex.foldCase) < 0) return;
+    IndexExt *e = indexFindExt(key, 1);
+    if (e->count == e->cap) {
+        e->cap = e->cap ? e->cap * 2 : 16;
+        e->ids = realloc(e->ids, e->cap * sizeof(int));
+        if (!e->ids) error("ERROR allocating index");
+    }
+    f->extEntry = e;
+    f->extPos = e->count;
+    e->ids[e->count++] = id;
+}
+
+// Removes a file from its posting list by moving the last entry into its place
+static void indexUnlinkExt(int id) {
+    IndexFile *f = &fileIndex.files[id];
+    IndexExt *e = f->extEntry;
+    if (!e) return;
+    int last = e->ids[--e->count];
+    e->ids[f->extPos] = last;
+    fileIndex.files[last].extPos = f->extPos;
+    f->extEntry = NULL;
+}
+
+// Forgets every change and starts a new epoch, so all tokens handed out so far expire.
+// File ids are reassigned by a crawl from scratch, so older records would name the wrong files.
+static void journalReset(void) {
+    for (size_t i = 0; changeJournal.ring && i < CHANGE_JOURNAL_SIZE; i++) {
+        free(changeJournal.ring[i].removed);
+        changeJournal.ring[i].removed = NULL;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    changeJournal.epoch = ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec) ^ ((uint64_t)getpid() << 40);
+    changeJournal.enabled = 0;
+}
+
+// Appends a change to the journal: file id was created or modified, or is about to be removed.
+// Called wherever the index itself changes.
+static void journalAdd(int id, int removed) {
+    if (!changeJournal.enabled) return;
+    if (!changeJournal.ring && !(changeJournal.ring = calloc(CHANGE_JOURNAL_SIZE, sizeof(ChangeRecord))))
+        error("ERROR allocating change journal");
+    char *path = NULL;
+    if (removed) {
+        char full[PATH_MAX];
+        indexFilePath(&fileIndex.files[id], full, sizeof(full));
+        if (!(path = strdup(full + strlen(fileIndex.dirs[0].path) + 1))) {
+            // A removal that cannot be recorded must not go unreported: a new epoch expires
+            // every token, so each client falls back to a full sync
+            journalReset();
+            changeJournal.enabled = 1;
+            return;
+        }
+    }
+    ChangeRecord *r = &changeJournal.ring[changeJournal.next % CHANGE_JOURNAL_SIZE];
+    free(r->removed);
+    r->removed = path;
+    r->id = removed ? -1 : id;
+    r->version = fileIndex.files[id].version;
+    changeJournal.next++;
+}
+
+// Registers a file not yet in the index under a free id and links it into the lookup table,
+// its name chain and its posting list. Size, times and mode are left to the caller.
+static int indexNewFile(int dir, const char *name) {
+    int id;
+    if ((fileIndex.slotUsed + 1) * 2 > fileIndex.slotCap)
+        indexRehash(fileIndex.slotCap ? fileIndex.slotCap * 2 : 1024);
+    if (fileIndex.freeCount > 0) {
+        id = fileIndex.freeFiles[--fileIndex.freeCount];
+    } else {
+        if (fileIndex.fileCount == fileIndex.fileCap) {
+            fileIndex.fileCap = fileIndex.fileCap ? fileIndex.fileCap * 2 : 1024;
+            fileIndex.files = realloc(fileIndex.files, fileIndex.fileCap * sizeof(IndexFile));
+            if (!fileIndex.files) error("ERROR allocating index");
+        }
+        id = fileIndex.fileCount++;
+        fileIndex.files[id].version = 0;
+    }
+    IndexFile *f = &fileIndex.files[id];
+    f->interned = indexIntern(name);
+    f->name = f->interned->str;
+    f->ext = strrchr(f->name, '.');
+    if (f->ext) f->ext++;
+    f->dir = dir;
+    f->live = 1;
+    f->prevSame = -1;
+    f->nextSame = f->interned->firstFile;
+    if (f->nextSame >= 0) fileIndex.files[f->nextSame].prevSame = id;
+    f->interned->firstFile = id;
+    f->interned->refs++;
+    f->prevInDir = -1;
+    f->nextInDir = fileIndex.dirs[dir].firstFile;
+    if (f->nextInDir >= 0) fileIndex.files[f->nextInDir].prevInDir = id;
+    fileIndex.dirs[dir].firstFile = id;
+    indexLinkExt(id);
+    fileIndex.slots[indexSlot(dir, name)] = id + 1;
+    fileIndex.slotUsed++;
+    fileIndex.liveFiles++;
+    return id;
+}
+
+// Adds or refreshes a regular file in the index
+static void indexPutFile(int dir, const char *name, const struct stat *sb) {
+    int id = indexFindFile(dir, name);
+    int rekey = 0;
+    if (id < 0) {
+        id = indexNewFile(dir, name);
+        rekey = 1;
+    } else if (fileIndex.files[id].size != sb->st_size || fileIndex.files[id].mtime != sb->st_mtim.tv_sec ||
+               fileIndex.files[id].mtimeNsec != sb->st_mtim.tv_nsec) {
+        // The ordered entries of the old keys are superseded, not searched for and removed
+        fileIndex.files[id].version++;
+        orderedRetire(&fileIndex.bySize);
+        orderedRetire(&fileIndex.byMtime);
+        rekey = 1;
+    }
+    IndexFile *f = &fileIndex.files[id];
+    f->size = sb->st_size;
+    f->mtime = sb->st_mtim.tv_sec;
+    f->mtimeNsec = sb->st_mtim.tv_nsec;
+    f->mode = sb->st_mode;
+    if (rekey) {
+        orderedInsert(&fileIndex.bySize, f->size, id, f->version);
+        orderedInsert(&fileIndex.byMtime, (int64_t)f->mtime * 1000000000 + f->mtimeNsec, id, f->version);
+        journalAdd(id, 0);
+    }
+    fileIndex.generation++;
+}
+
+// Drops a file from the index, keeping the lookup table free of holes
+static void indexRemoveFile(int id) {
+    IndexFile *f = &fileIndex.files[id];
+    journalAdd(id, 1);
+    size_t mask = fileIndex.slotCap - 1;
+    size_t i = indexSlot(f->dir, f->name);
+
+    // Backward-shift deletion for linear probing
+    fileIndex.slots[i] = 0;
+    for (size_t j = (i + 1) & mask; fileIndex.slots[j]; j = (j + 1) & mask) {
+        IndexFile *g = &fileIndex.files[fileIndex.slots[j] - 1];
+        size_t home = indexHash(g->dir, g->name) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            fileIndex.slots[i] = fileIndex.slots[j];
+            fileIndex.slots[j] = 0;
+            i = j;
+        }
+    }
+    fileIndex.slotUsed--;
+
+    if (f->prevSame >= 0) fileIndex.files[f->prevSame].nextSame = f->nextSame;
+    else f->interned->firstFile = f->nextSame;
+    if (f->nextSame >= 0) fileIndex.files[f->nextSame].prevSame = f->prevSame;
+    if (f->prevInDir >= 0) fileIndex.files[f->prevInDir].nextInDir = f->nextInDir;
+    else fileIndex.dirs[f->dir].firstFile = f->nextInDir;
+    if (f->nextInDir >= 0) fileIndex.files[f->nextInDir].prevInDir = f->prevInDir;
+    indexRelease(f->interned);
+    indexUnlinkExt(id);
+    f->interned = NULL;
+    f->name = NULL;
+    f->ext = NULL;
+    f->version++;
+    orderedRetire(&fileIndex.bySize);
+    orderedRetire(&fileIndex.byMtime);
+    f->live = 0;
+    fileIndex.liveFiles--;
+    if (fileIndex.freeCount == fileIndex.freeCap) {
+        fileIndex.freeCap = fileIndex.freeCap ? fileIndex.freeCap * 2 : 256;
+        fileIndex.freeFiles = realloc(fileIndex.freeFiles, fileIndex.freeCap * sizeof(int));
+        if (!fileIndex.freeFiles) error("ERROR allocating index");
+    }
+    fileIndex.freeFiles[fileIndex.freeCount++] = id;
+    fileIndex.generation++;
+}
+
+// The stamp of a directory stat'ed just before its entries are read. Directory mtimes come from
+// a coarse clock, so a change in the same tick as the stat may leave the mtime where it was;
+// a directory modified in the last two seconds gets no stamp and is read again at next startup.
+static int64_t indexDirStamp(const struct stat *sb) {
+    if (!sb || time(NULL) - sb->st_mtim.tv_sec < 2) return 0;
+    return (int64_t)sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec;
+}
+
+// Starts watching a directory for changes. Returns the watch descriptor, -1 if it cannot be
+// watched. An inode already watched through this inotify instance gets its existing descriptor.
+static int indexWatch(const char *path) {
+    int wd = inotify_add_watch(fileIndex.inotifyFd, path, INDEX_WATCH_MASK);
+    if (wd < 0) {
+        static atomic_int warned;
+        if (atomic_fetch_add(&warned, 1) == 0) perror("WARNING inotify_add_watch, parts of the index may go stale");
+    }
+    return wd;
+}
+
+// Registers a directory already watched under wd, -1 if unwatched
+static int indexInsertDir(const char *path, int parent, int64_t stamp, int wd) {
+    if (fileIndex.dirCount == fileIndex.dirCap) {
+        fileIndex.dirCap = fileIndex.dirCap ? fileIndex.dirCap * 2 : 256;
+        fileIndex.dirs = realloc(fileIndex.dirs, fileIndex.dirCap * sizeof(IndexDir));
+        if (!fileIndex.dirs) error("ERROR allocating index");
+    }
+    int id = fileIndex.dirCount++;
+    IndexDir *d = &fileIndex.dirs[id];
+    d->path = strdup(path);
+    d->parent = parent;
+    d->live = 1;
+    d->stamp = stamp;
+    d->firstFile = d->firstChild = -1;
+    d->prevSibling = -1;
+    d->nextSibling = parent >= 0 ? fileIndex.dirs[parent].firstChild : -1;
+    if (d->nextSibling >= 0) fileIndex.dirs[d->nextSibling].prevSibling = id;
+    if (parent >= 0) fileIndex.dirs[parent].firstChild = id;
+    d->wd = wd;
+    if (d->wd < 0) {
+        fileIndex.stale = 1;
+    } else {
+        if (d->wd >= fileIndex.watchCap) {
+            int newCap = fileIndex.watchCap ? fileIndex.watchCap : 256;
+            while (newCap <= d->wd) newCap *= 2;
+            fileIndex.watchDirs = realloc(fileIndex.watchDirs, newCap * sizeof(int));
+            if (!fileIndex.watchDirs) error("ERROR allocating index");
+            memset(fileIndex.watchDirs + fileIndex.watchCap, 0, (newCap - fileIndex.watchCap) * sizeof(int));
+            fileIndex.watchCap = newCap;
+        }
+        fileIndex.watchDirs[d->wd] = id + 1;
+    }
+    fileIndex.generation++;
+    return id;
+}
+
+// Registers a directory and starts watching it for changes. sb is its stat from before its
+// entries are read, NULL if unknown.
+static int indexAddDir(const char *path, int parent, const struct stat *sb) {
+    return indexInsertDir(path, parent, indexDirStamp(sb), indexWatch(path));
+}
+
+// Returns the id of the live child directory called name, or -1
+static int indexFindChildDir(int parent, const char *name) {
+    size_t parentLen = strlen(fileIndex.dirs[parent].path);
+    for (int id = fileIndex.dirs[parent].firstChild; id >= 0; id = fileIndex.dirs[id].nextSibling) {
+        if (strcmp(fileIndex.dirs[id].path + parentLen + 1, name) == 0) return id;
+    }
+    return -1;
+}
+
+// Drops a directory, everything below it and their watches from the index. The subtree is
+// walked through the child and file lists, so the cost follows its size, not the tree's.
+static void indexRemoveDir(int root) {
+    IndexDir *r = &fileIndex.dirs[root];
+    if (r->prevSibling >= 0) fileIndex.dirs[r->prevSibling].nextSibling = r->nextSibling;
+    else if (r->parent >= 0) fileIndex.dirs[r->parent].firstChild = r->nextSibling;
+    if (r->nextSibling >= 0) fileIndex.dirs[r->nextSibling].prevSibling = r->prevSibling;
+    r->nextSibling = r->prevSibling = -1;
+
+    // Depth first: a directory is dropped once its last subdirectory is gone
+    int id = root;
+    while (id >= 0) {
+        IndexDir *d = &fileIndex.dirs[id];
+        if (d->firstChild >= 0) {
+            int child = d->firstChild;
+            d->firstChild = fileIndex.dirs[child].nextSibling;
+            fileIndex.dirs[child].nextSibling = fileIndex.dirs[child].prevSibling = -1;
+            id = child;
+            continue;
+        }
+        while (d->firstFile >= 0) indexRemoveFile(d->firstFile);
+        if (d->wd >= 0) {
+            fileIndex.watchDirs[d->wd] = 0;
+            inotify_rm_watch(fileIndex.inotifyFd, d->wd);
+            d->wd = -1;
+        }
+        d->live = 0;
+        id = id == root ? -1 : d->parent;
+    }
+    fileIndex.generation++;
+}
+
+// Parallel directory walker. Each thread owns a deque of directories still to be read:
+// it pushes subdirectories and pops from the bottom of its own deque, keeping its walk
+// depth-first and cache-friendly. Idle threads steal from the top of other deques, where
+// the oldest and usually largest subtrees sit. Entries come straight from getdents64.
+
+// Layout of the records returned by getdents64
+struct linuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+enum {
+    WALK_CONTINUE,  // Keep going, descending into the entry if it is a directory
+    WALK_SKIP,      // Do not descend into this directory
+    WALK_STOP,      // Cancel the whole walk
+};
+
+// One directory entry as seen by a walk visitor
+typedef struct {
+    int dirFd;             // The containing directory, for fstatat
+    const char *dirPath;
+    long dirTag;           // Caller's tag for the containing directory
+    const char *name;
+    const char *path;      // Full path, only set for directories
+    unsigned char type;    // DT_* type, resolved with fstatat when the filesystem does not report it
+} WalkEntry;
+
+// Called concurrently from every walker thread. For a directory it may set *childTag,
+// which its own entries then carry as dirTag.
+typedef int (*WalkVisitor)(const WalkEntry *entry, long *childTag, void *arg);
+
+typedef struct {
+    long tag;
+    char path[];
+} WalkItem;
+
+typedef struct {
+    pthread_mutex_t lock;
+    WalkItem **items;   // Live items are items[top..bottom)
+    size_t top, bottom, cap;
+} WalkDeque;
+
+typedef struct {
+    WalkVisitor visit;
+    void *arg;
+    int threads;
+    WalkDeque *deques;
+    atomic_long pending;   // Directories pushed but not yet fully read
+    atomic_int stop;       // Set once a visitor cancels the walk
+    atomic_int idle;       // Threads waiting for work
+    pthread_mutex_t idleLock;
+    pthread_cond_t wake;
+} Walk;
+
+typedef struct {
+    Walk *walk;
+    int self;
+} WalkThread;
+
+#define WALK_DIRENT_BUFFER (32 * 1024)
+
+static int walkPush(WalkDeque *dq, WalkItem *item) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom == dq->cap && dq->top > 0) {
+        memmove(dq->items, dq->items + dq->top, (dq->bottom - dq->top) * sizeof(WalkItem *));
+        dq->bottom -= dq->top;
+        dq->top = 0;
+    }
+    if (dq->bottom == dq->cap) {
+        size_t cap = dq->cap ? dq->cap * 2 : 64;
+        WalkItem **grown = realloc(dq->items, cap * sizeof(WalkItem *));
+        if (!grown) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        dq->items = grown;
+        dq->cap = cap;
+    }
+    dq->items[dq->bottom++] = item;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+// Owner side: newest item first
+static WalkItem *walkPop(WalkDeque *dq) {
+    WalkItem *item = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) item = dq->items[--dq->bottom];
+    if (dq->bottom == dq->top) dq->top = dq->bottom = 0;
+    pthread_mutex_unlock(&dq->lock);
+    return item;
+}
+
+// Thief side: oldest item first
+static WalkItem *walkSteal(WalkDeque *dq) {
+    WalkItem *item = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) item = dq->items[dq->top++];
+    if (dq->bottom == dq->top) dq->top = dq->bottom = 0;
+    pthread_mutex_unlock(&dq->lock);
+    return item;
+}
+
+// Reads one directory, passing each entry to the visitor and queueing subdirectories
+static void walkDirectory(Walk *w, int self, const WalkItem *item) {
+    int fd = open(item->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return;
+    char *buf = malloc(WALK_DIRENT_BUFFER);
+    size_t pathLen = strlen(item->path);
+    long n;
+
+    while (buf && !atomic_load(&w->stop) && (n = syscall(SYS_getdents64, fd, buf, WALK_DIRENT_BUFFER)) > 0) {
+        for (long off = 0; off < n && !atomic_load(&w->stop); ) {
+            struct linuxDirent64 *d = (struct linuxDirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+                continue;
+
+            WalkEntry entry = { .dirFd = fd, .dirPath = item->path, .dirTag = item->tag, .name = d->d_name, .type = d->d_type };
+            if (entry.type == DT_UNKNOWN) {
+                struct stat sb;
+                if (fstatat(fd, d->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) continue;
+                entry.type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            WalkItem *child = NULL;
+            if (entry.type == DT_DIR) {
+                size_t nameLen = strlen(d->d_name);
+                child = malloc(sizeof(WalkItem) + pathLen + nameLen + 2);
+                if (!child) continue;
+                memcpy(child->path, item->path, pathLen);
+                child->path[pathLen] = '/';
+                memcpy(child->path + pathLen + 1, d->d_name, nameLen + 1);
+                child->tag = item->tag;
+                entry.path = child->path;
+            }
+
+            int action = w->visit(&entry, child ? &child->tag : NULL, w->arg);
+            if (action == WALK_STOP) atomic_store(&w->stop, 1);
+            if (!child) continue;
+            if (action != WALK_CONTINUE) {
+                free(child);
+                continue;
+            }
+            atomic_fetch_add(&w->pending, 1);
+            if (walkPush(&w->deques[self], child) < 0) {
+                free(child);
+                atomic_fetch_sub(&w->pending, 1);
+                continue;
+            }
+            if (atomic_load(&w->idle) > 0) {
+                pthread_mutex_lock(&w->idleLock);
+                pthread_cond_signal(&w->wake);
+                pthread_mutex_unlock(&w->idleLock);
+            }
+        }
+    }
+    free(buf);
+    close(fd);
+}
+
+static void *walkThread(void *arg) {
+    WalkThread *t = arg;
+    Walk *w = t->walk;
+    while (1) {
+        WalkItem *item = walkPop(&w->deques[t->self]);
+        for (int k = 1; !item && k < w->threads; k++)
+            item = walkSteal(&w->deques[(t->self + k) % w->threads]);
+        if (item) {
+            // After a cancel the remaining items are only drained
+            if (!atomic_load(&w->stop)) walkDirectory(w, t->self, item);
+            free(item);
+            if (atomic_fetch_sub(&w->pending, 1) == 1) {
+                pthread_mutex_lock(&w->idleLock);
+                pthread_cond_broadcast(&w->wake);
+                pthread_mutex_unlock(&w->idleLock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&w->idleLock);
+        if (atomic_load(&w->pending) == 0) {
+            pthread_mutex_unlock(&w->idleLock);
+            break;
+        }
+        // A push can slip in between the failed steal and this wait, so never sleep for long
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 10 * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        atomic_fetch_add(&w->idle, 1);
+        pthread_cond_timedwait(&w->wake, &w->idleLock, &until);
+        atomic_fetch_sub(&w->idle, 1);
+        pthread_mutex_unlock(&w->idleLock);
+    }
+    return NULL;
+}
+
+// Number of walker threads for a full tree scan; directory reads block on I/O, so
+// more threads than cores keep a fast device or a network filesystem busy
+static int walkThreads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    return n < MIN_WORKERS ? MIN_WORKERS : n;
+}
+
+// Walks everything below root with the given number of threads, the caller being one of them.
+// root itself is not visited; its entries carry rootTag. Returns 1 if a visitor cancelled the walk.
+static int walkTree(const char *root, long rootTag, WalkVisitor visit, void *arg, int threads) {
+    if (threads < 1) threads = 1;
+    Walk w = { .visit = visit, .arg = arg, .threads = threads };
+    WalkThread *ctx = calloc(threads, sizeof(WalkThread));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    w.deques = calloc(threads, sizeof(WalkDeque));
+    WalkItem *item = malloc(sizeof(WalkItem) + strlen(root) + 1);
+    if (!ctx || !tids || !w.deques || !item) {
+        free(ctx);
+        free(tids);
+        free(w.deques);
+        free(item);
+        return 0;
+    }
+    pthread_mutex_init(&w.idleLock, NULL);
+    pthread_cond_init(&w.wake, NULL);
+    for (int i = 0; i < threads; i++) pthread_mutex_init(&w.deques[i].lock, NULL);
+
+    item->tag = rootTag;
+    strcpy(item->path, root);
+    atomic_store(&w.pending, 1);
+    walkPush(&w.deques[0], item);
+
+    int started = 1;
+    for (int i = 0; i < threads; i++) {
+        ctx[i].walk = &w;
+        ctx[i].self = i;
+    }
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, walkThread, &ctx[i]) != 0) break;
+        started++;
+    }
+    // Threads that failed to start simply never steal; their deques stay empty
+    walkThread(&ctx[0]);
+    for (int i = 1; i < started; i++) pthread_join(tids[i], NULL);
+
+    for (int i = 0; i < threads; i++) {
+        free(w.deques[i].items);
+        pthread_mutex_destroy(&w.deques[i].lock);
+    }
+    pthread_mutex_destroy(&w.idleLock);
+    pthread_cond_destroy(&w.wake);
+    free(w.deques);
+    free(tids);
+    free(ctx);
+    return atomic_load(&w.stop);
+}
+
+// Serializes index updates from concurrent walker threads during a scan
+static pthread_mutex_t indexScanLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Walk visitor registering every directory and regular file below a scanned subtree.
+// The stat runs in parallel; only the index update itself is serialized.
+static int indexVisit(const WalkEntry *entry, long *childTag, void *arg) {
+    (void)arg;
+    if (entry->type == DT_DIR) {
+        if (strcmp(entry->path, fileIndex.skipPath) == 0) return WALK_SKIP;
+        struct stat sb;
+        int known = fstatat(entry->dirFd, entry->name, &sb, AT_SYMLINK_NOFOLLOW) == 0;
+        pthread_mutex_lock(&indexScanLock);
+        *childTag = indexAddDir(entry->path, entry->dirTag, known ? &sb : NULL);
+        pthread_mutex_unlock(&indexScanLock);
+        return WALK_CONTINUE;
+    }
+    struct stat sb;
+    if (entry->type == DT_REG && fstatat(entry->dirFd, entry->name, &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+        S_ISREG(sb.st_mode)) {
+        pthread_mutex_lock(&indexScanLock);
+        indexPutFile(entry->dirTag, entry->name, &sb);
+        pthread_mutex_unlock(&indexScanLock);
+    }
+    return WALK_CONTINUE;
+}
+
+// Indexes everything below an already registered directory
+static void indexScanDir(int dir, int threads) {
+    walkTree(fileIndex.dirs[dir].path, dir, indexVisit, NULL, threads);
+}
+
+// Empties the index and drops any snapshot mapping; the inotify instance and its watches stay
+static void indexClear(void) {
+    for (size_t i = 0; i < fileIndex.nameCap; i++) free(fileIndex.names[i]);
+    for (int id = 0; id < fileIndex.dirCount; id++) free(fileIndex.dirs[id].path);
+    free(fileIndex.slots);
+    fileIndex.slots = NULL;
+    fileIndex.slotCap = fileIndex.slotUsed = 0;
+    free(fileIndex.names);
+    fileIndex.names = NULL;
+    fileIndex.nameCap = fileIndex.nameUsed = 0;
+    for (size_t i = 0; i < fileIndex.extCap; i++) {
+        if (!fileIndex.exts[i]) continue;
+        free(fileIndex.exts[i]->ids);
+        free(fileIndex.exts[i]);
+    }
+    free(fileIndex.exts);
+    fileIndex.exts = NULL;
+    fileIndex.extCap = fileIndex.extUsed = 0;
+    orderedReset(&fileIndex.bySize);
+    orderedReset(&fileIndex.byMtime);
+    indexSnapshotUnmap();
+    fileIndex.dirCount = fileIndex.fileCount = fileIndex.freeCount = fileIndex.liveFiles = 0;
+    if (fileIndex.watchDirs) memset(fileIndex.watchDirs, 0, fileIndex.watchCap * sizeof(int));
+}
+
+// Discards the whole index and any snapshot mapping, leaving it empty for root
+static void indexReset(const char *root) {
+    indexClear();
+    if (fileIndex.inotifyFd >= 0) close(fileIndex.inotifyFd);
+    fileIndex.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fileIndex.inotifyFd < 0) perror("WARNING inotify_init1, the index will not be kept current");
+    fileIndex.stale = fileIndex.inotifyFd < 0;
+    // Archives written there would otherwise change the tree and end up in later archives
+    snprintf(fileIndex.skipPath, sizeof(fileIndex.skipPath), "%s/w24project", root);
+
+    journalReset();
+}
+
+// Discards the whole index and crawls the tree from scratch
+static void indexBuild(const char *root) {
+    struct stat sb;
+    indexReset(root);
+    int known = lstat(root, &sb) == 0;
+    indexScanDir(indexAddDir(root, -1, known ? &sb : NULL), walkThreads());
+    changeJournal.enabled = 1;
+}
+
+// Background crawls: the whole tree after inotify lost events, or a directory that was created
+// in or moved into it. A crawl collects the tree without the index lock, so queries keep being
+// served meanwhile, and adds the result to the index at the end. Until then inotify events
+// queue in the kernel, and those read before the crawl started wait in deferredEvents.
+#define INOTIFY_BUFFER (64 * 1024)
+
+static struct {
+    char buf[INOTIFY_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    size_t len;
+} deferredEvents;
+
+static int indexWakeFd = -1;  // Polled by the event loop; signalled when deferred events await a landed crawl
+
+typedef struct {
+    char *path;
+    int parent;
+    int wd;
+    int64_t stamp;
+} RebuildDir;
+
+typedef struct {
+    char *name;
+    int dir;
+    off_t size;
+    time_t mtime;
+    long mtimeNsec;
+    mode_t mode;
+} RebuildFile;
+
+typedef struct {
+    pthread_mutex_t lock;
+    RebuildDir *dirs;
+    int dirCount, dirCap;
+    RebuildFile *files;
+    size_t fileCount, fileCap;
+    int parent;             // Index directory the crawled one goes under, -1 to replace the whole index
+    char root[PATH_MAX];
+} IndexRebuild;
+
+// Records a directory of the crawl, watching it before its entries are read. Called with the
+// rebuild lock held. Returns its position in the crawl.
+static int rebuildAddDir(IndexRebuild *rb, const char *path, int parent, const struct stat *sb) {
+    if (rb->dirCount == rb->dirCap) {
+        rb->dirCap = rb->dirCap ? rb->dirCap * 2 : 256;
+        rb->dirs = realloc(rb->dirs, rb->dirCap * sizeof(RebuildDir));
+        if (!rb->dirs) error("ERROR allocating index");
+    }
+    RebuildDir *d = &rb->dirs[rb->dirCount];
+    if (!(d->path = strdup(path))) error("ERROR allocating index");
+    d->parent = parent;
+    d->wd = indexWatch(path);
+    d->stamp = indexDirStamp(sb);
+    return rb->dirCount++;
+}
+
+// Walk visitor collecting every directory and regular file for a rebuild
+static int rebuildVisit(const WalkEntry *entry, long *childTag, void *arg) {
+    IndexRebuild *rb = arg;
+    struct stat sb;
+    if (entry->type == DT_DIR) {
+        if (strcmp(entry->path, fileIndex.skipPath) == 0) return WALK_SKIP;
+        int known = fstatat(entry->dirFd, entry->name, &sb, AT_SYMLINK_NOFOLLOW) == 0;
+        pthread_mutex_lock(&rb->lock);
+        *childTag = rebuildAddDir(rb, entry->path, entry->dirTag, known ? &sb : NULL);
+        pthread_mutex_unlock(&rb->lock);
+        return WALK_CONTINUE;
+    }
+    if (entry->type != DT_REG || fstatat(entry->dirFd, entry->name, &sb, AT_SYMLINK_NOFOLLOW) < 0 ||
+        !S_ISREG(sb.st_mode))
+        return WALK_CONTINUE;
+    char *name = strdup(entry->name);
+    if (!name) error("ERROR allocating index");
+    pthread_mutex_lock(&rb->lock);
+    if (rb->fileCount == rb->fileCap) {
+        rb->fileCap = rb->fileCap ? rb->fileCap * 2 : 1024;
+        rb->files = realloc(rb->files, rb->fileCap * sizeof(RebuildFile));
+        if (!rb->files) error("ERROR allocating index");
+    }
+    rb->files[rb->fileCount++] = (RebuildFile){ name, (int)entry->dirTag, sb.st_size, sb.st_mtim.tv_sec,
+                                                sb.st_mtim.tv_nsec, sb.st_mode };
+    pthread_mutex_unlock(&rb->lock);
+    return WALK_CONTINUE;
+}
+
+// Crawls the tree, then adds the result to the index under the write lock: under its parent
+// directory for a subtree, in place of everything for a full rebuild. The inotify instance is
+// kept: directories still present keep their watches, which the crawl re-added before reading
+// them, so events queued meanwhile apply to the new entries once the event loop reads them.
+static void *indexRebuildMain(void *arg) {
+    IndexRebuild *rb = arg;
+    struct stat sb;
+    int known = lstat(rb->root, &sb) == 0;
+    rebuildAddDir(rb, rb->root, -1, known ? &sb : NULL);
+    walkTree(rb->root, 0, rebuildVisit, rb, walkThreads());
+
+    pthread_rwlock_wrlock(&indexLock);
+    int *oldWatches = NULL, oldCount = 0;
+    if (rb->parent < 0) {
+        if (!(oldWatches = malloc((fileIndex.dirCount + 1) * sizeof(int)))) error("ERROR allocating index");
+        for (int id = 0; id < fileIndex.dirCount; id++)
+            if (fileIndex.dirs[id].live && fileIndex.dirs[id].wd >= 0) oldWatches[oldCount++] = fileIndex.dirs[id].wd;
+        indexClear();
+        journalReset();
+        fileIndex.stale = 0;
+    }
+    // Crawl position -> index directory; a parent always comes before its children
+    int *dirMap = malloc(rb->dirCount * sizeof(int));
+    if (!dirMap) error("ERROR allocating index");
+    for (int i = 0; i < rb->dirCount; i++) {
+        int parent = i == 0 ? rb->parent : dirMap[rb->dirs[i].parent];
+        dirMap[i] = indexInsertDir(rb->dirs[i].path, parent, rb->dirs[i].stamp, rb->dirs[i].wd);
+        free(rb->dirs[i].path);
+    }
+    for (size_t i = 0; i < rb->fileCount; i++) {
+        const RebuildFile *rf = &rb->files[i];
+        struct stat fileSb = { .st_size = rf->size, .st_mode = rf->mode };
+        fileSb.st_mtim.tv_sec = rf->mtime;
+        fileSb.st_mtim.tv_nsec = rf->mtimeNsec;
+        indexPutFile(dirMap[rf->dir], rf->name, &fileSb);
+        free(rf->name);
+    }
+    // Directories that vanished or left the tree while events were lost
+    for (int i = 0; i < oldCount; i++) {
+        int wd = oldWatches[i];
+        if (fileIndex.watchDirs[wd] == 0) inotify_rm_watch(fileIndex.inotifyFd, wd);
+    }
+    changeJournal.enabled = 1;
+    fileIndex.rebuilding = 0;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &fileIndex.inotifyFd };
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fileIndex.inotifyFd, &ev) < 0) {
+        perror("WARNING epoll_ctl, the index will not be kept current");
+        fileIndex.stale = 1;
+    }
+    if (deferredEvents.len > 0 && eventfd_write(indexWakeFd, 1) < 0) perror("WARNING eventfd_write");
+    if (rb->parent < 0) {
+        printf("Rebuilt index, %d files in %d directories\n", fileIndex.liveFiles, fileIndex.dirCount);
+        fflush(stdout);
+    }
+    pthread_rwlock_unlock(&indexLock);
+
+    free(dirMap);
+    free(oldWatches);
+    free(rb->dirs);
+    free(rb->files);
+    pthread_mutex_destroy(&rb->lock);
+    free(rb);
+    return NULL;
+}
+
+// Starts a background crawl of root, a new directory under parent or the whole tree when
+// parent is -1. Called with the write lock held. The inotify descriptor leaves the event loop
+// until the crawl lands, its events queuing in the kernel meanwhile. Only a full rebuild marks
+// the index stale: events were lost, so queries fall back to walking the tree. A missing subtree
+// is merely late, as with any event not yet applied.
+static void indexStartCrawl(const char *root, int parent) {
+    if (parent < 0) fileIndex.stale = 1;
+    IndexRebuild *rb = calloc(1, sizeof(IndexRebuild));
+    if (!rb) error("ERROR allocating index");
+    pthread_mutex_init(&rb->lock, NULL);
+    rb->parent = parent;
+    snprintf(rb->root, sizeof(rb->root), "%s", root);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, indexRebuildMain, rb) != 0) {
+        pthread_mutex_destroy(&rb->lock);
+        free(rb);
+        if (parent < 0) {
+            // Still stale, but events keep being applied to what the index does hold
+            perror("WARNING pthread_create, the index stays stale");
+        } else {
+            struct stat sb;
+            int known = lstat(root, &sb) == 0;
+            indexScanDir(indexAddDir(root, parent, known ? &sb : NULL), 1);
+        }
+        return;
+    }
+    pthread_detach(tid);
+    fileIndex.rebuilding = 1;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fileIndex.inotifyFd, NULL);
+}
+
+// Applies a single inotify event to the index
+static void indexApplyEvent(const struct inotify_event *ev) {
+    if (ev->wd < 0 || ev->wd >= fileIndex.watchCap || fileIndex.watchDirs[ev->wd] == 0) return;
+    int dir = fileIndex.watchDirs[ev->wd] - 1;
+
+    if (ev->mask & IN_IGNORED) {
+        // The watched directory is gone; its removal arrives through the parent
+        fileIndex.watchDirs[ev->wd] = 0;
+        fileIndex.dirs[dir].wd = -1;
+        return;
+    }
+    if (ev->len == 0) return;
+    fileIndex.dirs[dir].stamp = 0;  // Its entries changed, so the next startup reads it again
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", fileIndex.dirs[dir].path, ev->name);
+
+    if (ev->mask & IN_ISDIR) {
+        int child = indexFindChildDir(dir, ev->name);
+        if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            if (child >= 0) indexRemoveDir(child);
+        } else if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && child < 0 && strcmp(path, fileIndex.skipPath) != 0) {
+            // A tree moved in can be arbitrarily large, so it is never crawled on the event loop
+            indexStartCrawl(path, dir);
+        }
+        return;
+    }
+
+    struct stat sb;
+    int id = indexFindFile(dir, ev->name);
+    if (!(ev->mask & (IN_DELETE | IN_MOVED_FROM)) && lstat(path, &sb) == 0 && S_ISREG(sb.st_mode)) {
+        indexPutFile(dir, ev->name, &sb);
+    } else if (id >= 0) {
+        indexRemoveFile(id);
+    }
+}
+
+// Drains pending inotify events without blocking, the deferred ones first. Stops as soon as an
+// event starts a background crawl, keeping the rest of the buffer for when it lands.
+static void indexProcessEvents(void) {
+    char buf[INOTIFY_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    if (fileIndex.rebuilding) return;
+    len = deferredEvents.len;
+    memcpy(buf, deferredEvents.buf, len);
+    deferredEvents.len = 0;
+    while (len > 0 || (len = read(fileIndex.inotifyFd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost, the only safe option is a full rebuild; the rest of
+                // the buffer is covered by it
+                indexStartCrawl(fileIndex.dirs[0].path, -1);
+                return;
+            }
+            indexApplyEvent(ev);
+            if (fileIndex.rebuilding) {
+                deferredEvents.len = buf + len - p;
+                memcpy(deferredEvents.buf, p, deferredEvents.len);
+                return;
+            }
+        }
+        len = 0;
+    }
+    if (len < 0 && errno != EAGAIN && errno != EINTR) perror("ERROR reading inotify events");
+}
+
+// Index snapshot, ~/w24project/index.snap: a header, flat arrays of the directories, the files and
+// the entries of both ordered indexes, then the string table those arrays point into. Every field
+// is fixed-size and in host byte order, so a starting server maps the file and reads it in place.
+#define INDEX_SNAPSHOT_MAGIC "W24INDEX"
+
+typedef struct {
+    char magic[8];
+    uint32_t version;       // INDEX_SNAPSHOT_VERSION; a foreign byte order fails this check too
+    uint32_t checksum;      // CRC-32 of everything after the header
+    uint64_t size;          // Of the whole file
+    uint64_t dirCount, fileCount;
+    uint64_t dirs, files, bySize, byMtime, strings;  // Section offsets from the start of the file
+    uint64_t stringsSize;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t path;          // Offset in the string table
+    int64_t stamp;
+    int32_t parent;         // Always an earlier directory, -1 for the root
+    uint32_t reserved;
+} SnapshotDir;
+
+// Files are numbered by their position, which is the id the ordered entries use
+typedef struct {
+    uint64_t name;          // Offset in the string table
+    int64_t size;
+    int64_t mtime;
+    int32_t mtimeNsec;
+    int32_t dir;
+    uint32_t mode;
+    uint32_t reserved;
+} SnapshotFile;
+
+static uint32_t snapshotChecksum(const unsigned char *data, size_t len) {
+    uLong crc = crc32(0, NULL, 0);
+    while (len > 0) {
+        uInt n = len > (1u << 30) ? 1u << 30 : (uInt)len;
+        crc = crc32(crc, data, n);
+        data += n;
+        len -= n;
+    }
+    return crc;
+}
+
+// Writes the index to its snapshot. The image is assembled under the read lock and written once
+// the lock is released, to a temporary file renamed into place, so neither a starting server nor
+// an existing mapping ever sees a partial snapshot. Returns 0 on success.
+static int indexSnapshotSave(void) {
+    char dir[PATH_MAX], path[PATH_MAX + 16], tmpPath[PATH_MAX + 48];
+
+    pthread_rwlock_rdlock(&indexLock);
+    int *dirMap = malloc((fileIndex.dirCount + 1) * sizeof(int));  // Index directory -> snapshot one
+    uint64_t dirCount = 0, fileCount = fileIndex.liveFiles, stringsSize = 0;
+    for (int id = 0; dirMap && id < fileIndex.dirCount; id++) {
+        dirMap[id] = fileIndex.dirs[id].live ? (int)dirCount++ : -1;
+        if (fileIndex.dirs[id].live) stringsSize += strlen(fileIndex.dirs[id].path) + 1;
+    }
+    for (int id = 0; id < fileIndex.fileCount; id++)
+        if (fileIndex.files[id].live) stringsSize += strlen(fileIndex.files[id].name) + 1;
+    size_t size = sizeof(SnapshotHeader) + dirCount * sizeof(SnapshotDir) + fileCount * sizeof(SnapshotFile) +
+                  2 * fileCount * sizeof(OrderedEntry) + stringsSize;
+    unsigned char *image = dirMap && dirCount > 0 ? calloc(1, size) : NULL;
+    SnapshotHeader *h = (SnapshotHeader *)image;
+    if (image) {
+        memcpy(h->magic, INDEX_SNAPSHOT_MAGIC, sizeof(h->magic));
+        h->version = INDEX_SNAPSHOT_VERSION;
+        h->size = size;
+        h->dirCount = dirCount;
+        h->fileCount = fileCount;
+        h->dirs = sizeof(SnapshotHeader);
+        h->files = h->dirs + dirCount * sizeof(SnapshotDir);
+        h->bySize = h->files + fileCount * sizeof(SnapshotFile);
+        h->byMtime = h->bySize + fileCount * sizeof(OrderedEntry);
+        h->strings = h->byMtime + fileCount * sizeof(OrderedEntry);
+        h->stringsSize = stringsSize;
+
+        SnapshotDir *dirs = (SnapshotDir *)(image + h->dirs);
+        SnapshotFile *files = (SnapshotFile *)(image + h->files);
+        OrderedEntry *bySize = (OrderedEntry *)(image + h->bySize), *byMtime = (OrderedEntry *)(image + h->byMtime);
+        char *strings = (char *)image + h->strings;
+        uint64_t used = 0, n = 0;
+        for (int id = 0; id < fileIndex.dirCount; id++) {
+            const IndexDir *d = &fileIndex.dirs[id];
+            if (!d->live) continue;
+            // A removed directory takes its whole subtree along, so a live one has a live parent
+            SnapshotDir *sd = &dirs[dirMap[id]];
+            sd->path = used;
+            sd->stamp = d->stamp;
+            sd->parent = d->parent < 0 ? -1 : dirMap[d->parent];
+            used += stpcpy(strings + used, d->path) - (strings + used) + 1;
+        }
+        for (int id = 0; id < fileIndex.fileCount; id++) {
+            const IndexFile *f = &fileIndex.files[id];
+            if (!f->live) continue;
+            files[n] = (SnapshotFile){ used, f->size, f->mtime, f->mtimeNsec, dirMap[f->dir], f->mode, 0 };
+            bySize[n] = (OrderedEntry){ f->size, n, 0 };
+            byMtime[n] = (OrderedEntry){ (int64_t)f->mtime * 1000000000 + f->mtimeNsec, n, 0 };
+            used += stpcpy(strings + used, f->name) - (strings + used) + 1;
+            n++;
+        }
+    }
+    unsigned long generation = fileIndex.generation;
+    snprintf(dir, sizeof(dir), "%s", fileIndex.skipPath);
+    pthread_rwlock_unlock(&indexLock);
+    free(dirMap);
+    if (!image) return -1;
+
+    qsort(image + h->bySize, fileCount, sizeof(OrderedEntry), orderedCompare);
+    qsort(image + h->byMtime, fileCount, sizeof(OrderedEntry), orderedCompare);
+    h->checksum = snapshotChecksum(image + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader));
+
+    snprintf(path, sizeof(path), "%s/index.snap", dir);
+    snprintf(tmpPath, sizeof(tmpPath), "%s/index.snap.%ld", dir, (long)getpid());
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        perror("WARNING creating index snapshot directory");
+        free(image);
+        return -1;
+    }
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int status = fd >= 0 && writeAll(fd, image, size) == 0 && fdatasync(fd) == 0 ? 0 : -1;
+    if (fd >= 0 && close(fd) < 0) status = -1;
+    if (status == 0 && rename(tmpPath, path) < 0) status = -1;
+    if (status == 0) {
+        indexSnapshot.generation = generation;
+    } else {
+        perror("WARNING writing index snapshot");
+        unlink(tmpPath);
+    }
+    free(image);
+    return status;
+}
+
+// Checks a mapped snapshot of size bytes before anything in it is trusted. Returns what is
+// wrong with it, or NULL if it is sound and was taken of root.
+static const char *snapshotCheck(const unsigned char *map, size_t size, const char *root) {
+    const SnapshotHeader *h = (const SnapshotHeader *)map;
+    if (memcmp(h->magic, INDEX_SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 || h->version != INDEX_SNAPSHOT_VERSION)
+        return "unknown format";
+    if (h->size != size || h->dirCount == 0 || h->dirCount > size / sizeof(SnapshotDir) ||
+        h->fileCount > size / sizeof(SnapshotFile) || h->dirCount > INT_MAX || h->fileCount > INT_MAX)
+        return "bad size";
+    if (h->dirs != sizeof(SnapshotHeader) || h->files != h->dirs + h->dirCount * sizeof(SnapshotDir) ||
+        h->bySize != h->files + h->fileCount * sizeof(SnapshotFile) ||
+        h->byMtime != h->bySize + h->fileCount * sizeof(OrderedEntry) ||
+        h->strings != h->byMtime + h->fileCount * sizeof(OrderedEntry) || h->strings + h->stringsSize != size ||
+        h->stringsSize == 0 || map[size - 1] != '\0')
+        return "bad layout";
+    if (snapshotChecksum(map + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader)) != h->checksum)
+        return "checksum mismatch";
+
+    const SnapshotDir *dirs = (const SnapshotDir *)(map + h->dirs);
+    const SnapshotFile *files = (const SnapshotFile *)(map + h->files);
+    const OrderedEntry *entries = (const OrderedEntry *)(map + h->bySize);
+    for (uint64_t i = 0; i < h->dirCount; i++)
+        if (dirs[i].path >= h->stringsSize || (i == 0 ? dirs[i].parent != -1 : dirs[i].parent < 0 || (uint64_t)dirs[i].parent >= i))
+            return "bad directory";
+    if (strcmp((const char *)map + h->strings + dirs[0].path, root) != 0) return "taken of another tree";
+    for (uint64_t i = 0; i < h->fileCount; i++)
+        if (files[i].name >= h->stringsSize || files[i].dir < 0 || (uint64_t)files[i].dir >= h->dirCount)
+            return "bad file";
+    // Range queries binary-search these arrays in place, so each must be sorted the way
+    // orderedCompare sorts and carry the key of the file it names
+    for (uint64_t i = 0; i < 2 * h->fileCount; i++) {  // bySize and byMtime lie back to back
+        const OrderedEntry *e = &entries[i];
+        if (e->id < 0 || (uint64_t)e->id >= h->fileCount || e->version != 0) return "bad ordered entry";
+        const SnapshotFile *f = &files[e->id];
+        int64_t key = i < h->fileCount ? f->size : f->mtime * 1000000000 + f->mtimeNsec;
+        if (e->key != key) return "bad ordered entry";
+        if (i % h->fileCount > 0 && orderedCompare(e - 1, e) >= 0) return "ordered index out of order";
+    }
+    return NULL;
+}
+
+// Reads a directory again once the snapshot found its mtime moved: each regular file is stat'ed
+// into the index and marked in seen, and subdirectories not in known, the sorted paths of the
+// directories the snapshot brought back, are crawled.
+static void snapshotRereadDir(int dir, const char **known, size_t knownCount, unsigned char *seen, size_t seenCount) {
+    const char *dirPath = fileIndex.dirs[dir].path;
+    struct stat sb;
+    int fd = open(dirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    fileIndex.dirs[dir].stamp = fstat(fd, &sb) == 0 ? indexDirStamp(&sb) : 0;
+
+    struct dirent *entry;
+    char path[PATH_MAX];
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (fstatat(fd, entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dirPath, entry->d_name);
+        const char *key = path;
+        if (S_ISREG(sb.st_mode)) {
+            indexPutFile(dir, entry->d_name, &sb);
+            int id = indexFindFile(dir, entry->d_name);
+            if (id >= 0 && (size_t)id < seenCount) seen[id] = 1;
+        } else if (S_ISDIR(sb.st_mode) && strcmp(path, fileIndex.skipPath) != 0 &&
+                   !bsearch(&key, known, knownCount, sizeof(char *), stringSort)) {
+            indexScanDir(indexAddDir(path, dir, &sb), walkThreads());
+        }
+    }
+    closedir(d);
+}
+
+// Rebuilds the index from its snapshot instead of crawling the tree. Files are re-linked into the
+// hash tables and posting lists straight from the mapping, and the ordered indexes use its sorted
+// arrays in place. Then each directory is stat'ed once: vanished ones are dropped, and only those
+// whose mtime moved are read again. Rewriting a file in place leaves its directory's mtime alone,
+// so such a change made while no server ran goes unseen until the file changes again.
+// Returns -1 if there is no usable snapshot of root.
+static int indexSnapshotLoad(const char *root) {
+    char path[PATH_MAX + 32];
+    struct stat sb, dirSb;
+    snprintf(path, sizeof(path), "%s/w24project/index.snap", root);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    // Shared and read-only: the pages stay in the page cache, not in a private copy per process
+    size_t mapSize = fstat(fd, &sb) == 0 && sb.st_size >= (off_t)sizeof(SnapshotHeader) ? (size_t)sb.st_size : 0;
+    unsigned char *map = mapSize > 0 ? mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    const char *problem = snapshotCheck(map, mapSize, root);
+    if (problem) {
+        fprintf(stderr, "WARNING ignoring index snapshot %s: %s\n", path, problem);
+        munmap(map, mapSize);
+        return -1;
+    }
+
+    const SnapshotHeader *h = (const SnapshotHeader *)map;
+    const SnapshotDir *dirs = (const SnapshotDir *)(map + h->dirs);
+    const SnapshotFile *files = (const SnapshotFile *)(map + h->files);
+    const char *strings = (const char *)map + h->strings;
+    int dirCount = h->dirCount, fileCount = h->fileCount;
+    int *dirMap = malloc(dirCount * sizeof(int));                      // Snapshot directory -> index one
+    unsigned char *reread = calloc(dirCount, 1);                       // By index directory
+    unsigned char *seen = calloc(fileCount + 1, 1);
+    const char **known = malloc(dirCount * sizeof(char *));
+    if (!dirMap || !reread || !seen || !known) error("ERROR allocating index");
+
+    indexReset(root);
+    size_t knownCount = 0;
+    for (int i = 0; i < dirCount; i++) {
+        const char *dirPath = strings + dirs[i].path;
+        int parent = i > 0 ? dirMap[dirs[i].parent] : -1;
+        dirMap[i] = -1;
+        if ((i > 0 && parent < 0) || lstat(dirPath, &dirSb) < 0 || !S_ISDIR(dirSb.st_mode)) continue;
+        int id = dirMap[i] = indexAddDir(dirPath, parent, NULL);
+        fileIndex.dirs[id].stamp = dirs[i].stamp;
+        reread[id] = dirs[i].stamp == 0 || dirs[i].stamp != (int64_t)dirSb.st_mtim.tv_sec * 1000000000 + dirSb.st_mtim.tv_nsec;
+        known[knownCount++] = fileIndex.dirs[id].path;
+    }
+    if (dirMap[0] < 0) {
+        free(dirMap);
+        free(reread);
+        free(seen);
+        free(known);
+        munmap(map, mapSize);
+        return -1;
+    }
+
+    // Files keep their snapshot ids, which the mapped ordered entries refer to. A file whose
+    // directory vanished leaves a free id whose version no longer matches its entries.
+    size_t slotCap = 1024;
+    while (slotCap < 2 * (size_t)fileCount + 2) slotCap *= 2;
+    indexRehash(slotCap);
+    if (fileIndex.fileCap < fileCount) {
+        fileIndex.files = realloc(fileIndex.files, fileCount * sizeof(IndexFile));
+        if (!fileIndex.files) error("ERROR allocating index");
+        fileIndex.fileCap = fileCount;
+    }
+    int dead = 0;
+    for (int k = 0; k < fileCount; k++) {
+        const SnapshotFile *sf = &files[k];
+        if (dirMap[sf->dir] < 0) {
+            IndexFile *f = &fileIndex.files[fileIndex.fileCount++];
+            memset(f, 0, sizeof(*f));
+            f->nextSame = f->prevSame = -1;
+            f->version = 1;
+            dead++;
+            continue;
+        }
+        IndexFile *f = &fileIndex.files[indexNewFile(dirMap[sf->dir], strings + sf->name)];
+        f->size = sf->size;
+        f->mtime = sf->mtime;
+        f->mtimeNsec = sf->mtimeNsec;
+        f->mode = sf->mode;
+    }
+    if (fileIndex.freeCap < dead) {
+        fileIndex.freeFiles = realloc(fileIndex.freeFiles, dead * sizeof(int));
+        if (!fileIndex.freeFiles) error("ERROR allocating index");
+        fileIndex.freeCap = dead;
+    }
+    for (int k = 0; k < fileCount; k++)
+        if (!fileIndex.files[k].live) fileIndex.freeFiles[fileIndex.freeCount++] = k;
+
+    OrderedIndex *ordered[2] = { &fileIndex.bySize, &fileIndex.byMtime };
+    const uint64_t offsets[2] = { h->bySize, h->byMtime };
+    for (int i = 0; i < 2; i++) {
+        ordered[i]->sorted = (OrderedEntry *)(map + offsets[i]);
+        ordered[i]->count = ordered[i]->cap = fileCount;
+        ordered[i]->stale = dead;
+        ordered[i]->mapped = 1;
+    }
+    indexSnapshot.map = map;
+    indexSnapshot.size = mapSize;
+
+    // Reconcile with the tree; files gone from a directory read again are the ones not seen
+    qsort(known, knownCount, sizeof(char *), stringSort);
+    int rereads = 0;
+    for (int id = 0; id < fileIndex.dirCount && id < dirCount; id++) {
+        if (!reread[id] || !fileIndex.dirs[id].live) continue;
+        snapshotRereadDir(id, known, knownCount, seen, fileCount);
+        rereads++;
+    }
+    for (int k = 0; k < fileCount; k++) {
+        const IndexFile *f = &fileIndex.files[k];
+        if (f->live && f->dir < dirCount && reread[f->dir] && !seen[k]) indexRemoveFile(k);
+    }
+    printf("Loaded index snapshot, %d of %d directories read again\n", rereads, fileIndex.dirCount);
+    // Rewrite the snapshot soon if it no longer matches, if only for fresh directory stamps
+    indexSnapshot.generation = rereads > 0 || dead > 0 ? 0 : fileIndex.generation;
+    changeJournal.enabled = 1;
+
+    free(dirMap);
+    free(reread);
+    free(seen);
+    free(known);
+    return 0;
+}
+
+// Keeps the snapshot close to the live index: rewritten at most every INDEX_SNAPSHOT_INTERVAL
+// seconds, and only once something changed since the last one
+static void *indexSnapshotMain(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_rwlock_rdlock(&indexLock);
+        int changed = !fileIndex.rebuilding && fileIndex.generation != indexSnapshot.generation;
+        pthread_rwlock_unlock(&indexLock);
+        if (changed) indexSnapshotSave();
+        sleep(INDEX_SNAPSHOT_INTERVAL);
+    }
+    return NULL;
+}
+
+// Batched statx. Every stat of a batch is queued on an io_uring at once, so a network
+// filesystem sees them all in flight instead of one round-trip per entry. Kernels or
+// sandboxes without io_uring get the same batch spread over a few threads instead.
+
+#define STATX_RING_ENTRIES 256
+#define STATX_THREADS 8
+#define DIRLIST_STATX_MASK (STATX_TYPE | STATX_MTIME | STATX_BTIME)
+
+// One statx of a batch, relative to dirFd
+typedef struct {
+    const char *name;
+    struct statx stx;
+    int result;             // 0 or a negative errno
+} StatxJob;
+
+// Set once io_uring_setup fails, so later batches go straight to the threads
+static atomic_int ioUringUnavailable;
+
+// Runs the jobs through a private io_uring. Returns -1 if io_uring cannot be used at all.
+static int statxUring(int dirFd, StatxJob *jobs, size_t count) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    unsigned entries = count < STATX_RING_ENTRIES ? count : STATX_RING_ENTRIES;
+    int ring = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring < 0) return -1;
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    char *cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+               mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    int status = 0;
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        status = -1;
+        goto out;
+    }
+
+    unsigned *sqTail = (unsigned *)(sq + params.sq_off.tail);
+    unsigned *sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    unsigned *sqArray = (unsigned *)(sq + params.sq_off.array);
+    unsigned *cqHead = (unsigned *)(cq + params.cq_off.head);
+    unsigned *cqTail = (unsigned *)(cq + params.cq_off.tail);
+    unsigned *cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    struct io_uring_cqe *cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    for (size_t next = 0; next < count; ) {
+        // Queue as much of the batch as the ring holds, then wait for all of it
+        unsigned queued = 0, tail = *sqTail;
+        while (next < count && queued < params.sq_entries) {
+            unsigned slot = tail & *sqMask;
+            struct io_uring_sqe *sqe = &sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dirFd;
+            sqe->addr = (uintptr_t)jobs[next].name;
+            sqe->len = DIRLIST_STATX_MASK;
+            sqe->off = (uintptr_t)&jobs[next].stx;
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            sqe->user_data = next;
+            sqArray[slot] = slot;
+            tail++;
+            next++;
+            queued++;
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+        unsigned toSubmit = queued, reaped = 0;
+        while (reaped < queued) {
+            int n = syscall(__NR_io_uring_enter, ring, toSubmit, queued - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                status = -1;
+                goto out;
+            }
+            toSubmit -= n < (int)toSubmit ? (unsigned)n : toSubmit;
+            unsigned head = *cqHead;
+            while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+                jobs[cqe->user_data].result = cqe->res;
+                head++;
+                reaped++;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+
+out:
+    if (sqes != MAP_FAILED) munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+    if (cq != MAP_FAILED && cq != sq) munmap(cq, cqSize);
+    if (sq != MAP_FAILED) munmap(sq, sqSize);
+    close(ring);
+    return status;
+}
+
+typedef struct {
+    int dirFd;
+    StatxJob *jobs;
+    size_t count, stride, first;
+} StatxSlice;
+
+static void *statxSliceMain(void *arg) {
+    StatxSlice *slice = arg;
+    for (size_t i = slice->first; i < slice->count; i += slice->stride) {
+        StatxJob *job = &slice->jobs[i];
+        job->result = statx(slice->dirFd, job->name, AT_SYMLINK_NOFOLLOW, DIRLIST_STATX_MASK, &job->stx) == 0 ? 0 : -errno;
+    }
+    return NULL;
+}
+
+// Fallback: the batch is interleaved over up to STATX_THREADS threads, the caller included
+static void statxThreads(int dirFd, StatxJob *jobs, size_t count) {
+    size_t threads = count < STATX_THREADS ? count : STATX_THREADS;
+    StatxSlice slices[STATX_THREADS];
+    pthread_t tids[STATX_THREADS];
+    size_t started = 1;
+    for (size_t t = 0; t < threads; t++) slices[t] = (StatxSlice){ dirFd, jobs, count, threads, t };
+    for (size_t t = 1; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, statxSliceMain, &slices[t]) != 0) break;
+        started++;
+    }
+    // Slices whose thread failed to start run here
+    for (size_t t = 0; t < threads; t++)
+        if (t == 0 || t >= started) statxSliceMain(&slices[t]);
+    for (size_t t = 1; t < started; t++) pthread_join(tids[t], NULL);
+}
+
+static void statxBatch(int dirFd, StatxJob *jobs, size_t count) {
+    if (count == 0) return;
+    if (!atomic_load(&ioUringUnavailable) && statxUring(dirFd, jobs, count) == 0) return;
+    atomic_store(&ioUringUnavailable, 1);
+    statxThreads(dirFd, jobs, count);
+}
+
+void listDirectoriesByCreationTime(Request *req) {
+    DIR *dir;
+    struct dirent *entry;
+    StringList names = { .arena = req->arena };
+    char buffer[BUFFER_SIZE * 2];
+    char timeBuff[64];
+
+    char *homeDir = getenv("HOME");
+    uint64_t walkStart = statsClock();
+    if ((dir = opendir(homeDir)) == NULL) {
+        sendError(req, "Failed to open directory.\n");
+        return;
+    }
+
+    // Collect the names first, then stat them all as one batch
+    while ((entry = readdir(dir)) != NULL) {
+        if ((entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) &&
+            strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
+            stringListAdd(&names, entry->d_name) < 0) {
+            closedir(dir);
+            sendError(req, "Out of memory\n");
+            return;
+        }
+    }
+    StatxJob *jobs = arenaAlloc(req->arena, names.count * sizeof(StatxJob) + 1);
+    DirEntry *directories = arenaAlloc(req->arena, names.count * sizeof(DirEntry) + 1);
+    if (!jobs || !directories) {
+        closedir(dir);
+        sendError(req, "Out of memory\n");
+        return;
+    }
+    for (size_t i = 0; i < names.count; i++) jobs[i].name = stringListGet(&names, i);
+    statxBatch(dirfd(dir), jobs, names.count);
+    closedir(dir);
+    statPhase(req, PHASE_WALK, walkStart);
+
+    size_t dirCount = 0;
+    for (size_t i = 0; i < names.count; i++) {
+        const struct statx *stx = &jobs[i].stx;
+        if (jobs[i].result < 0 || !S_ISDIR(stx->stx_mode)) continue;
+        directories[dirCount].name = (char *)jobs[i].name;
+        directories[dirCount].created = (stx->stx_mask & STATX_BTIME) ? stx->stx_btime.tv_sec : stx->stx_mtime.tv_sec;
+        dirCount++;
+    }
+
+    qsort(directories, dirCount, sizeof(DirEntry), timeSort);
+
+    for (size_t i = 0; i < dirCount; i++) {
+        struct tm tmBuf;
+        strftime(timeBuff, sizeof(timeBuff), "%Y-%m-%d %H:%M:%S", localtime_r(&directories[i].created, &tmBuf));
+        snprintf(buffer, sizeof(buffer), "%-30s %s\n", timeBuff, directories[i].name);
+        sendData(req, buffer);
+    }
+}
+
+void listDirectoriesAlphabetically(Request *req) {
+    DIR* dir;
+    struct dirent* entry;
+    StringList names = { .arena = req->arena };
+    char buffer[BUFFER_SIZE * 2];
+
+    uint64_t walkStart = statsClock();
+    if ((dir = opendir(getenv("HOME"))) == NULL) {
+        sendError(req, "Failed to open directory.\n");
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type == DT_DIR && stringListAdd(&names, entry->d_name) < 0) {
+            closedir(dir);
+            sendError(req, "Out of memory\n");
+            return;
+        }
+    }
+    closedir(dir);
+    statPhase(req, PHASE_WALK, walkStart);
+
+    const char **directories = arenaAlloc(req->arena, names.count * sizeof(char *) + 1);
+    if (!directories) {
+        sendError(req, "Out of memory\n");
+        return;
+    }
+    for (size_t i = 0; i < names.count; i++) directories[i] = stringListGet(&names, i);
+    qsort(directories, names.count, sizeof(char*), alphaSort);
+
+    for (size_t i = 0; i < names.count; i++) {
+        snprintf(buffer, sizeof(buffer), "%s\n", directories[i]);
+        sendData(req, buffer);
+    }
+}
+
+
+// New function to create the w24project directory and check for errors
+int createDirectory(const char *dir) {
+    struct stat st = {0};
+
+    if (stat(dir, &st) == -1) {
+        if (mkdir(dir, 0777) != 0) {
+            return -1;  // Return an error if directory creation fails
+        }
+    }
+    return 0;  // Return success if directory exists or was created successfully
+}
+
+// Parallel compression, after pigz: the tar stream is cut into blocks that worker threads
+// compress independently and the producer writes back in order.
+typedef enum {
+    BLOCK_FREE,     // May be filled by the producer
+    BLOCK_QUEUED,   // Waiting for a compression thread
+    BLOCK_RUNNING,
+    BLOCK_DONE,     // Compressed, waiting to be written in order
+} ArchiveBlockState;
+
+typedef struct {
+    ArchiveBlockState state;
+    unsigned char *in;      // dictLen bytes of history, then len bytes of input
+    size_t dictLen, len;
+    unsigned char *out;
+    size_t outLen, outCap;
+    uLong crc;              // Of the len input bytes only, gzip
+    int last;               // Finishes the stream
+    int failed;
+} ArchiveBlock;
+
+// A format archives can be produced in, chosen per request with '-z name[:level]'.
+// gzip blocks are primed with the 32 KiB of input before them and end on a byte boundary with
+// a sync flush; written behind one header and a trailer whose CRC is stitched together with
+// crc32_combine, they form one ordinary gzip member. zstd and lz4 blocks are whole frames,
+// which their tools decode back to back. 'none' writes the tar stream as it is.
+typedef struct ArchiveCodec {
+    const char *name;
+    const char *suffix;                     // Of the archive file name, after "temp"
+    int minLevel, maxLevel, defaultLevel;
+    size_t blockSize;                       // Input per block
+    int primed;                             // Blocks carry GZIP_DICT bytes of history
+    void *(*open)(int level);               // Per-thread compressor, NULL on failure
+    void (*close)(void *state);
+    size_t (*bound)(size_t len);            // Largest output of a block of len bytes
+    int (*compress)(void *state, ArchiveBlock *b);  // NULL stores blocks as they are
+} ArchiveCodec;
+
+static void *gzipOpen(int level) {
+    z_stream *zs = calloc(1, sizeof(z_stream));
+    // Negative windowBits: raw deflate, the writer frames the gzip member itself
+    if (zs && deflateInit2(zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(zs);
+        zs = NULL;
+    }
+    return zs;
+}
+
+static void gzipClose(void *state) {
+    deflateEnd(state);
+    free(state);
+}
+
+static size_t gzipBound(size_t len) {
+    return compressBound(len) + 64;  // Room for the sync flush marker
+}
+
+static int gzipCompress(void *state, ArchiveBlock *b) {
+    z_stream *zs = state;
+    deflateReset(zs);
+    if (b->dictLen > 0) deflateSetDictionary(zs, b->in, b->dictLen);
+    zs->next_in = b->in + b->dictLen;
+    zs->avail_in = b->len;
+    zs->next_out = b->out;
+    zs->avail_out = b->outCap;
+    int rc = deflate(zs, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+    b->outLen = b->outCap - zs->avail_out;
+    b->crc = crc32(0, b->in + b->dictLen, b->len);
+    // outCap covers the bound, so one call always consumes the whole block
+    if (b->last) return rc == Z_STREAM_END ? 0 : -1;
+    return rc == Z_OK && zs->avail_in == 0 && zs->avail_out > 0 ? 0 : -1;
+}
+
+#ifdef HAVE_ZSTD
+static void *zstdOpen(int level) {
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (cctx && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level))) {
+        ZSTD_freeCCtx(cctx);
+        cctx = NULL;
+    }
+    return cctx;
+}
+
+static void zstdClose(void *state) {
+    ZSTD_freeCCtx(state);
+}
+
+static size_t zstdBound(size_t len) {
+    return ZSTD_compressBound(len);
+}
+
+static int zstdCompress(void *state, ArchiveBlock *b) {
+    size_t n = ZSTD_compress2(state, b->out, b->outCap, b->in + b->dictLen, b->len);
+    if (ZSTD_isError(n)) return -1;
+    b->outLen = n;
+    return 0;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static void *lz4Open(int level) {
+    LZ4F_preferences_t *prefs = calloc(1, sizeof(LZ4F_preferences_t));
+    if (prefs) prefs->compressionLevel = level;
+    return prefs;
+}
+
+static void lz4Close(void *state) {
+    free(state);
+}
+
+static size_t lz4Bound(size_t len) {
+    return LZ4F_compressFrameBound(len, NULL);
+}
+
+static int lz4Compress(void *state, ArchiveBlock *b) {
+    size_t n = LZ4F_compressFrame(b->out, b->outCap, b->in + b->dictLen, b->len, state);
+    if (LZ4F_isError(n)) return -1;
+    b->outLen = n;
+    return 0;
+}
+#endif
+
+static const ArchiveCodec archiveCodecs[] = {
+    { "gzip", ".tar.gz", 0, 9, 6, 128 * 1024, 1, gzipOpen, gzipClose, gzipBound, gzipCompress },
+#ifdef HAVE_ZSTD
+    { "zstd", ".tar.zst", 1, 19, 3, 1024 * 1024, 0, zstdOpen, zstdClose, zstdBound, zstdCompress },
+#endif
+#ifdef HAVE_LZ4
+    { "lz4", ".tar.lz4", 0, 12, 0, 1024 * 1024, 0, lz4Open, lz4Close, lz4Bound, lz4Compress },
+#endif
+    { "none", ".tar", 0, 0, 0, 128 * 1024, 0, NULL, NULL, NULL, NULL },
+};
+#define ARCHIVE_CODEC_COUNT (sizeof(archiveCodecs) / sizeof(archiveCodecs[0]))
+
+static int gzipLevel = 6;    // -l, the level of 'gzip' when a request names none
+static int archiveThreads;   // -j, 0 means one per CPU
+
+// Parses a '-z name[:level]' spec at spec, specLen bytes long, into req. Returns -1 for a codec
+// or level this server does not offer.
+static int parseCodecSpec(Request *req, const char *spec, size_t specLen) {
+    size_t nameLen = strcspn(spec, ": ");
+    const ArchiveCodec *codec = NULL;
+    for (size_t i = 0; i < ARCHIVE_CODEC_COUNT; i++)
+        if (strlen(archiveCodecs[i].name) == nameLen && strncmp(spec, archiveCodecs[i].name, nameLen) == 0)
+            codec = &archiveCodecs[i];
+    if (!codec) return -1;
+    int level = codec->defaultLevel;
+    if (codec == &archiveCodecs[0]) level = gzipLevel;
+    if (nameLen < specLen) {
+        char *end;
+        level = strtol(spec + nameLen + 1, &end, 10);
+        if (end != spec + specLen || end == spec + nameLen + 1) return -1;
+    }
+    if (level < codec->minLevel || level > codec->maxLevel) return -1;
+    req->codec = codec;
+    req->level = level;
+    return 0;
+}
+
+// Strips the leading archive options from the command arguments at args and records them in req:
+// '-z name[:level]' picks the codec, '-p' asks for a part archive without the tar end-of-archive
+// blocks, so a client can concatenate parts from several servers, and '-r <id>:<offset>' resumes
+// an archive the client already holds offset bytes of. Without -z the request gets gzip at the
+// -l level. Returns -1 for a malformed option or a codec or level this server does not offer.
+static int takeArchiveOptions(Request *req, char *args) {
+    req->codec = &archiveCodecs[0];
+    req->level = gzipLevel;
+    req->part = 0;
+    req->resumeId = req->resumeOffset = 0;
+    char *rest = args;
+    for (;;) {
+        if (strncmp(rest, "-p ", 3) == 0) {
+            req->part = 1;
+            rest += 3;
+        } else if (strncmp(rest, "-z ", 3) == 0) {
+            char *spec = rest + 3;
+            size_t specLen = strcspn(spec, " ");
+            if (parseCodecSpec(req, spec, specLen) < 0) return -1;
+            rest = spec + specLen;
+        } else if (strncmp(rest, "-r ", 3) == 0) {
+            char *end;
+            req->resumeId = strtoull(rest + 3, &end, 16);
+            if (*end != ':') return -1;
+            req->resumeOffset = strtoull(end + 1, &end, 10);
+            if (*end != ' ' && *end != '\0') return -1;
+            rest = end;
+        } else {
+            break;
+        }
+        while (*rest == ' ') rest++;
+    }
+    memmove(args, rest, strlen(rest) + 1);
+    return 0;
+}
+
+// "gzip:6", or just the name for codecs without levels; also the codec part of cache keys
+static void codecLabel(const Request *req, char *buf, size_t len) {
+    if (req->codec->minLevel == req->codec->maxLevel) snprintf(buf, len, "%s", req->codec->name);
+    else snprintf(buf, len, "%s:%d", req->codec->name, req->level);
+}
+
+// Answers 'codecs': one line per codec this build offers, with its level range and default
+void sendCodecs(Request *req) {
+    char line[BUFFER_SIZE];
+    for (size_t i = 0; i < ARCHIVE_CODEC_COUNT; i++) {
+        const ArchiveCodec *c = &archiveCodecs[i];
+        int dflt = c == &archiveCodecs[0] ? gzipLevel : c->defaultLevel;
+        if (c->minLevel == c->maxLevel) snprintf(line, sizeof(line), "%s\n", c->name);
+        else snprintf(line, sizeof(line), "%s %d-%d (default %d)\n", c->name, c->minLevel, c->maxLevel, dflt);
+        sendData(req, line);
+    }
+}
+
+// What a client needs to check and resume an archive besides its bytes
+typedef struct {
+    uint64_t contentId;         // FNV-1a of the size and the CRCs, so equal archives get equal ids
+    uint32_t *crcs;             // CRC-32 of every ARCHIVE_CHECK_CHUNK bytes, the last one possibly short
+    uint32_t crcCount;
+} ArchiveDigest;
+
+// Streaming tar writer: tar blocks go into ArchiveBlocks and out to fd in order
+typedef struct {
+    int fd;                               // Destination of the compressed stream
+    struct stat outStat;                  // Identity of fd, so the archive never packs itself
+    int failed;
+    const ArchiveCodec *codec;
+    int level;
+    int part;                             // Leave out the end-of-archive blocks
+    int threads;                          // Compression threads, started with the second block
+    int started;
+    pthread_t *pool;
+    pthread_mutex_t lock;                 // Guards block states, nextJob and stop
+    pthread_cond_t queued, done;
+    int stop;
+    ArchiveBlock *blocks;                 // Ring of slots: 2 per thread, or 1 when compressing inline
+    int slots;
+    int head, fill, nextJob;              // Oldest unwritten, being filled, next for a thread
+    uLong crc;
+    unsigned long long totalIn;           // Tar bytes, before compression
+    unsigned long long totalOut;          // Bytes written to fd
+    uLong outCrc;                         // Of the output since the last ARCHIVE_CHECK_CHUNK boundary
+    ArchiveDigest digest;
+    uint32_t crcCap;
+    void *producerState;                  // Compressor of the producer before the pool starts
+    unsigned char in[ARCHIVE_CHUNK];      // Tar headers and padding
+} ArchiveWriter;
+
+static void *archiveThreadMain(void *arg) {
+    ArchiveWriter *aw = arg;
+    void *state = aw->codec->open(aw->level);
+    pthread_mutex_lock(&aw->lock);
+    while (1) {
+        ArchiveBlock *b = &aw->blocks[aw->nextJob];
+        if (b->state != BLOCK_QUEUED) {
+            if (aw->stop) break;
+            pthread_cond_wait(&aw->queued, &aw->lock);
+            continue;
+        }
+        b->state = BLOCK_RUNNING;
+        aw->nextJob = (aw->nextJob + 1) % aw->slots;
+        pthread_mutex_unlock(&aw->lock);
+        b->failed = !state || aw->codec->compress(state, b) < 0;
+        pthread_mutex_lock(&aw->lock);
+        b->state = BLOCK_DONE;
+        pthread_cond_broadcast(&aw->done);
+    }
+    pthread_mutex_unlock(&aw->lock);
+    if (state) aw->codec->close(state);
+    return NULL;
+}
+
+// Writes compressed bytes to the archive file, checksumming them per ARCHIVE_CHECK_CHUNK
+static int archiveEmit(ArchiveWriter *aw, const unsigned char *buf, size_t len) {
+    if (writeAll(aw->fd, buf, len) < 0) return -1;
+    while (len > 0) {
+        size_t take = ARCHIVE_CHECK_CHUNK - aw->totalOut % ARCHIVE_CHECK_CHUNK;
+        if (take > len) take = len;
+        aw->outCrc = crc32(aw->outCrc, buf, take);
+        aw->totalOut += take;
+        buf += take;
+        len -= take;
+        if (aw->totalOut % ARCHIVE_CHECK_CHUNK != 0) continue;
+        if (aw->digest.crcCount == aw->crcCap) {
+            uint32_t cap = aw->crcCap ? aw->crcCap * 2 : 64;
+            uint32_t *crcs = realloc(aw->digest.crcs, cap * sizeof(uint32_t));
+            if (!crcs) return -1;
+            aw->digest.crcs = crcs;
+            aw->crcCap = cap;
+        }
+        aw->digest.crcs[aw->digest.crcCount++] = aw->outCrc;
+        aw->outCrc = crc32(0, NULL, 0);
+    }
+    return 0;
+}
+
+// Gives a slot its buffers the first time it is filled
+static int archiveBlockAlloc(ArchiveWriter *aw, ArchiveBlock *b) {
+    if (b->in) return 0;
+    const ArchiveCodec *c = aw->codec;
+    b->in = malloc((c->primed ? GZIP_DICT : 0) + c->blockSize);
+    if (c->compress) {
+        b->outCap = c->bound(c->blockSize);
+        b->out = malloc(b->outCap);
+    }
+    return b->in && (b->out || !c->compress) ? 0 : -1;
+}
+
+// Waits for the oldest block, writes it and returns its slot to the producer
+static void archiveWriteHead(ArchiveWriter *aw) {
+    ArchiveBlock *b = &aw->blocks[aw->head];
+    pthread_mutex_lock(&aw->lock);
+    while (b->state != BLOCK_DONE) pthread_cond_wait(&aw->done, &aw->lock);
+    pthread_mutex_unlock(&aw->lock);
+    const unsigned char *out = aw->codec->compress ? b->out : b->in + b->dictLen;
+    size_t outLen = aw->codec->compress ? b->outLen : b->len;
+    if (b->failed || (!aw->failed && archiveEmit(aw, out, outLen) < 0)) aw->failed = 1;
+    if (aw->codec->primed) aw->crc = crc32_combine(aw->crc, b->crc, b->len);
+    aw->totalIn += b->len;
+    pthread_mutex_lock(&aw->lock);
+    b->state = BLOCK_FREE;
+    pthread_mutex_unlock(&aw->lock);
+    aw->head = (aw->head + 1) % aw->slots;
+}
+
+// Moves from a single inline slot to a ring served by aw->threads threads
+static void archiveStartPool(ArchiveWriter *aw) {
+    aw->started = 1;
+    ArchiveBlock *ring = calloc(2 * aw->threads, sizeof(ArchiveBlock));
+    pthread_t *pool = calloc(aw->threads, sizeof(pthread_t));
+    if (!ring || !pool) {
+        free(ring);
+        free(pool);
+        return;  // Keep compressing inline
+    }
+    ring[0] = aw->blocks[0];
+    free(aw->blocks);
+    aw->blocks = ring;
+    aw->slots = 2 * aw->threads;
+    aw->pool = pool;
+    int started = 0;
+    for (int i = 0; i < aw->threads; i++)
+        if (pthread_create(&pool[i], NULL, archiveThreadMain, aw) == 0) started++;
+    if (started == 0) {
+        // No threads: the ring still works, the producer compresses each block itself
+        free(pool);
+        aw->pool = NULL;
+    }
+    aw->threads = started;
+}
+
+// Hands the block being filled to compression and starts the next one with its history.
+// Blocks until a slot is free, so at most 2 * threads blocks are in memory.
+static void archiveSubmit(ArchiveWriter *aw, int last) {
+    ArchiveBlock *b = &aw->blocks[aw->fill];
+    b->last = last;
+    if (!last && !aw->started && aw->threads > 1 && aw->codec->compress) {
+        archiveStartPool(aw);
+        b = &aw->blocks[aw->fill];
+    }
+    if (aw->pool) {
+        pthread_mutex_lock(&aw->lock);
+        b->state = BLOCK_QUEUED;
+        pthread_cond_signal(&aw->queued);
+        pthread_mutex_unlock(&aw->lock);
+    } else {
+        if (aw->codec->compress) b->failed = aw->codec->compress(aw->producerState, b) < 0;
+        b->state = BLOCK_DONE;
+    }
+    if (last) return;
+
+    int next = (aw->fill + 1) % aw->slots;
+    while (aw->blocks[next].state != BLOCK_FREE) archiveWriteHead(aw);
+    ArchiveBlock *n = &aw->blocks[next];
+    if (archiveBlockAlloc(aw, n) < 0) {
+        aw->failed = 1;
+        n->dictLen = 0;
+    } else if (aw->codec->primed) {
+        // The slot's own input only travels once it is written, so memmove covers next == fill
+        size_t total = b->dictLen + b->len;
+        n->dictLen = total < GZIP_DICT ? total : GZIP_DICT;
+        memmove(n->in, b->in + total - n->dictLen, n->dictLen);
+    }
+    n->len = 0;
+    aw->fill = next;
+}
+
+// Space left in the block being filled; archiveCommit accounts for bytes placed there
+static unsigned char *archiveReserve(ArchiveWriter *aw, size_t *room) {
+    ArchiveBlock *b = &aw->blocks[aw->fill];
+    if (aw->failed) return NULL;
+    if (b->len == aw->codec->blockSize) archiveSubmit(aw, 0);
+    b = &aw->blocks[aw->fill];
+    *room = aw->codec->blockSize - b->len;
+    return aw->failed ? NULL : b->in + b->dictLen + b->len;
+}
+
+static void archiveCommit(ArchiveWriter *aw, size_t len) {
+    aw->blocks[aw->fill].len += len;
+}
+
+// Appends len bytes to the tar stream
+static int archiveWrite(ArchiveWriter *aw, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        size_t room;
+        unsigned char *dst = archiveReserve(aw, &room);
+        if (!dst) return -1;
+        if (room > len) room = len;
+        memcpy(dst, p, room);
+        archiveCommit(aw, room);
+        p += room;
+        len -= room;
+    }
+    return 0;
+}
+
+// Starts an archive in the given codec on fd. Returns NULL if out of memory;
+// other failures surface from archiveClose.
+static ArchiveWriter *archiveOpen(int fd, const ArchiveCodec *codec, int level) {
+    ArchiveWriter *aw = calloc(1, sizeof(ArchiveWriter));
+    if (!aw) return NULL;
+    aw->fd = fd;
+    fstat(fd, &aw->outStat);
+    aw->codec = codec;
+    aw->level = level;
+    aw->threads = archiveThreads > 0 ? archiveThreads : sysconf(_SC_NPROCESSORS_ONLN);
+    aw->slots = 1;
+    aw->blocks = calloc(1, sizeof(ArchiveBlock));
+    aw->crc = crc32(0, NULL, 0);
+    aw->outCrc = crc32(0, NULL, 0);
+    pthread_mutex_init(&aw->lock, NULL);
+    pthread_cond_init(&aw->queued, NULL);
+    pthread_cond_init(&aw->done, NULL);
+    if (codec->compress) aw->producerState = codec->open(level);
+    if (!aw->blocks || (codec->compress && !aw->producerState) || archiveBlockAlloc(aw, &aw->blocks[0]) < 0) {
+        aw->failed = 1;
+        return aw;
+    }
+
+    // Fixed gzip header: no name, no timestamp, Unix
+    static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    if (codec->primed && archiveEmit(aw, header, sizeof(header)) < 0) aw->failed = 1;
+    return aw;
+}
+
+// Stores value as a NUL-terminated octal field, or base-256 when it does not fit (GNU extension)
+static void tarNumber(char *field, size_t width, unsigned long long value) {
+    if (value < (1ULL << (3 * (width - 1)))) {
+        field[width - 1] = '\0';
+        for (size_t i = width - 1; i > 0; i--) {
+            field[i - 1] = (char)('0' + (value & 7));
+            value >>= 3;
+        }
+        return;
+    }
+    field[0] = (char)0x80;
+    for (size_t i = width - 1; i > 0; i--) {
+        field[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+// Fills in a ustar header block for an entry called name
+static void tarHeader(unsigned char *block, const char *name, char type, mode_t mode,
+                      unsigned long long size, time_t mtime, uid_t uid, gid_t gid) {
+    char *h = (char *)block;
+    memset(block, 0, TAR_BLOCK);
+    strncpy(h, name, 100);
+    tarNumber(h + 100, 8, mode & 07777);
+    tarNumber(h + 108, 8, uid);
+    tarNumber(h + 116, 8, gid);
+    tarNumber(h + 124, 12, size);
+    tarNumber(h + 136, 12, mtime < 0 ? 0 : (unsigned long long)mtime);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    // The checksum is computed with its own field set to spaces
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) sum += block[i];
+    snprintf(h + 148, 8, "%06o", sum);
+}
+
+// Appends the file at path to the archive under the entry name, returns -1 if it was skipped
+static int archiveAddFile(ArchiveWriter *aw, const char *path, const char *name) {
+    struct stat sb;
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) return -1;  // Vanished since it was indexed; skip it like tar --ignore-failed-read
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+        (sb.st_dev == aw->outStat.st_dev && sb.st_ino == aw->outStat.st_ino)) {
+        close(fd);
+        return -1;
+    }
+
+    // Names that do not fit the header travel in a preceding GNU long-name entry
+    size_t nameLen = strlen(name);
+    if (nameLen > 100) {
+        tarHeader(aw->in, "././@LongLink", 'L', 0644, nameLen + 1, 0, 0, 0);
+        archiveWrite(aw, aw->in, TAR_BLOCK);
+        size_t padded = (nameLen + 1 + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        memset(aw->in, 0, padded);
+        memcpy(aw->in, name, nameLen);
+        archiveWrite(aw, aw->in, padded);
+    }
+    tarHeader(aw->in, name, '0', sb.st_mode, sb.st_size, sb.st_mtime, sb.st_uid, sb.st_gid);
+    archiveWrite(aw, aw->in, TAR_BLOCK);
+
+    // Stream exactly the size recorded in the header, zero-filling if the file shrank meanwhile.
+    // File data is read straight into the compression block.
+    unsigned long long left = sb.st_size;
+    while (left > 0) {
+        size_t room;
+        unsigned char *dst = archiveReserve(aw, &room);
+        if (!dst) break;
+        size_t want = left < room ? left : room;
+        ssize_t n = read(fd, dst, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            memset(dst, 0, want);
+            n = want;
+        }
+        archiveCommit(aw, n);
+        left -= n;
+    }
+    close(fd);
+
+    size_t tail = sb.st_size % TAR_BLOCK;
+    if (tail) {
+        memset(aw->in, 0, TAR_BLOCK - tail);
+        archiveWrite(aw, aw->in, TAR_BLOCK - tail);
+    }
+    return aw->failed ? -1 : 0;
+}
+
+// Writes the end-of-archive marker, drains the compression threads and frees the writer.
+// Returns -1 on any failure; otherwise *rawSize gets the uncompressed tar size and *digest the
+// checksums and content id, whose CRC array the caller then owns.
+static int archiveClose(ArchiveWriter *aw, unsigned long long *rawSize, ArchiveDigest *digest) {
+    if (!aw->failed && !aw->part) {
+        memset(aw->in, 0, 2 * TAR_BLOCK);
+        archiveWrite(aw, aw->in, 2 * TAR_BLOCK);
+    }
+    if (!aw->failed) {
+        archiveSubmit(aw, 1);
+        while (aw->head != aw->fill) archiveWriteHead(aw);
+        archiveWriteHead(aw);
+
+        // gzip trailer: CRC-32 and input size modulo 2^32, little-endian
+        unsigned char trailer[8];
+        for (int i = 0; i < 4; i++) {
+            trailer[i] = (unsigned char)(aw->crc >> (8 * i));
+            trailer[4 + i] = (unsigned char)(aw->totalIn >> (8 * i));
+        }
+        if (aw->codec->primed && !aw->failed && archiveEmit(aw, trailer, sizeof(trailer)) < 0) aw->failed = 1;
+    } else if (aw->blocks) {
+        // Let queued blocks finish so no thread still reads them
+        while (aw->head != aw->fill) archiveWriteHead(aw);
+    }
+
+    if (aw->pool) {
+        pthread_mutex_lock(&aw->lock);
+        aw->stop = 1;
+        pthread_cond_broadcast(&aw->queued);
+        pthread_mutex_unlock(&aw->lock);
+        for (int i = 0; i < aw->threads; i++) pthread_join(aw->pool[i], NULL);
+        free(aw->pool);
+    }
+    for (int i = 0; aw->blocks && i < aw->slots; i++) {
+        free(aw->blocks[i].in);
+        free(aw->blocks[i].out);
+    }
+    free(aw->blocks);
+    if (aw->producerState) aw->codec->close(aw->producerState);
+    pthread_mutex_destroy(&aw->lock);
+    pthread_cond_destroy(&aw->queued);
+    pthread_cond_destroy(&aw->done);
+    // Checksum of the last, short chunk, then the id over the size and every checksum
+    if (!aw->failed && aw->totalOut % ARCHIVE_CHECK_CHUNK != 0) {
+        uint32_t *crcs = realloc(aw->digest.crcs, (aw->digest.crcCount + 1) * sizeof(uint32_t));
+        if (crcs) {
+            crcs[aw->digest.crcCount++] = aw->outCrc;
+            aw->digest.crcs = crcs;
+        } else {
+            aw->failed = 1;
+        }
+    }
+    uint64_t id = 14695981039346656037ULL;
+    for (int i = 0; i < 8; i++) id = (id ^ ((aw->totalOut >> (8 * i)) & 0xff)) * 1099511628211ULL;
+    for (uint32_t i = 0; i < aw->digest.crcCount; i++)
+        for (int j = 0; j < 4; j++) id = (id ^ ((aw->digest.crcs[i] >> (8 * j)) & 0xff)) * 1099511628211ULL;
+    aw->digest.contentId = id ? id : 1;  // 0 means no resume
+
+    int failed = aw->failed;
+    *rawSize = aw->totalIn;
+    if (failed) free(aw->digest.crcs);
+    else *digest = aw->digest;
+    free(aw);
+    return failed ? -1 : 0;
+}
+
+// Function to count the number of extensions and check for duplicates
+// Splits the space-separated extensions in place into list, which holds MAX_EXTENSIONS entries.
+// Returns -1 on a duplicate and -3 if there are none. There is no count limit: each extension
+// is one posting-list lookup.
+int validateExtensions(char *extensions, char **list, int *count) {
+    char *token;
+    char *save;
+
+    *count = 0;
+    for (token = strtok_r(extensions, " ", &save); token; token = strtok_r(NULL, " ", &save)) {
+        // Check for duplicate extensions
+        for (int i = 0; i < *count; i++) {
+            if (strcmp(list[i], token) == 0) {
+                // Duplicate extension found
+                return -1;
+            }
+        }
+        list[(*count)++] = token;
+    }
+    if (*count == 0) { // No extensions provided
+        return -3;
+    }
+    return 0; // All good
+}
+
+// Delivers a finished archive from offset on: an ARCHIVE frame, a CHECKSUMS frame with the CRC-32
+// of every ARCHIVE_CHECK_CHUNK so the client can verify what it keeps, then DATA frames.
+// The bytes go from the page cache to the socket with sendfile, never through user space.
+void sendArchive(Request *req, int fd, const char *name, unsigned long long rawSize, const char *codec,
+                 const ArchiveDigest *digest, off_t offset) {
+    struct stat tarStat;
+    uint32_t *crcs = malloc(digest->crcCount * sizeof(uint32_t) + 1);
+    if (!crcs || fstat(fd, &tarStat) < 0) {
+        sendError(req, "Failed to open packed archive.\n");
+        free(crcs);
+        return;
+    }
+    for (uint32_t i = 0; i < digest->crcCount; i++) crcs[i] = htonl(digest->crcs[i]);
+    if (offset < 0 || offset > tarStat.st_size) offset = 0;
+
+    ArchiveInfo info = {
+        .size = htobe64(tarStat.st_size), .rawSize = htobe64(rawSize), .contentId = htobe64(digest->contentId),
+        .offset = htobe64(offset), .checkChunk = htonl(ARCHIVE_CHECK_CHUNK), .checkCount = htonl(digest->crcCount),
+    };
+    snprintf(info.name, sizeof(info.name), "%s", name);
+    snprintf(info.codec, sizeof(info.codec), "%s", codec);
+    int status = sendFrame(req, OP_ARCHIVE, 0, &info, sizeof(info));
+    if (status == 0) status = sendFrame(req, OP_CHECKSUMS, 0, crcs, digest->crcCount * sizeof(uint32_t));
+    free(crcs);
+    if (status < 0) return;
+    uint64_t start = statsClock();
+
+    // Each chunk is one frame, so replies to other requests can interleave between chunks
+    off_t first = offset;
+    while (offset < tarStat.st_size) {
+        off_t chunk = tarStat.st_size - offset;
+        if (chunk > FRAME_DATA_CHUNK) chunk = FRAME_DATA_CHUNK;
+        FrameHeader header;
+        frameHeaderInit(&header, OP_DATA, 0, req->id, chunk);
+
+        Conn *conn = req->conn;
+        pthread_mutex_lock(&conn->writeLock);
+        off_t end = offset + chunk;
+        // Buffered replies to other requests go out ahead of the header in the same call
+        if (connFlush(conn, &header, sizeof(header), NULL, 0, MSG_MORE) < 0) end = -1;
+        int full = end >= 0 && conn->pending != NULL;
+        while (!full && offset < end) {
+            ssize_t n = sendfile(conn->fd, fd, &offset, end - offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) full = 1;
+            if (n <= 0) break;
+        }
+        if (full) {
+            // The client is behind: the event loop sends the rest and this worker moves on
+            if (connQueueArchive(conn, fd, offset, tarStat.st_size, end - offset, req->id) == 0) {
+                offset = end = tarStat.st_size;
+            } else {
+                connDiscard(conn);
+                end = -1;
+            }
+        }
+        pthread_mutex_unlock(&conn->writeLock);
+        if (offset < end || end < 0) break;
+    }
+    req->sendMicros += statsClock() - start;
+    req->bytesSent += offset - first;
+    if (offset < tarStat.st_size) {
+        // The client cannot resynchronise after a short frame, so drop the connection
+        perror("ERROR sending archive");
+        shutdown(req->conn->fd, SHUT_RDWR);
+    }
+}
+
+// Collects the ids of the files an archive command selects; called with the index read lock held
+typedef int (*IndexQuery)(const void *arg, IdList *out);
+
+// Outcome of building one cached archive
+typedef enum {
+    CACHE_BUILDING,  // A worker is packing it; others wait instead of packing it again
+    CACHE_READY,     // The archive is on disk at path
+    CACHE_EMPTY,     // Nothing matched, there is no file
+    CACHE_FAILED,    // Packing failed; the entry is already out of the cache
+} CacheState;
+
+// A finished or in-progress archive, identified by its normalized query and the index
+// generation it was built from. Any change to the tree makes every older entry unreachable.
+typedef struct CacheEntry {
+    char *key;
+    unsigned long generation;
+    char *path;                 // ~/w24project/cache/<pid>-<seq><codec suffix>
+    off_t size;
+    unsigned long long rawSize; // Of the tar stream inside
+    ArchiveDigest digest;       // Checksums and content id, for resumed downloads
+    time_t lastUsed;            // Monotonic seconds of the last acquire or release
+    CacheState state;
+    int refs;                   // Requests using the entry; only unreferenced entries are evicted
+    struct CacheEntry *prev, *next;  // LRU list, most recently used first
+} CacheEntry;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t built;       // Broadcast whenever an entry leaves CACHE_BUILDING
+    CacheEntry *head, *tail;
+    off_t bytes;                // Size of the archives currently on disk
+    off_t budget;
+    time_t ttl;                 // Idle seconds after which an archive is reclaimed
+    unsigned long generation;   // Newest index generation seen; older entries can never hit again
+    unsigned long seq;          // Names cache files uniquely within this process
+} archiveCache = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0,
+                   ARCHIVE_CACHE_BUDGET, ARCHIVE_CACHE_TTL, 0, 0 };
+
+static time_t cacheNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static void cacheUnlink(CacheEntry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else archiveCache.head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else archiveCache.tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void cachePushFront(CacheEntry *e) {
+    e->next = archiveCache.head;
+    if (e->next) e->next->prev = e;
+    else archiveCache.tail = e;
+    archiveCache.head = e;
+}
+
+static void cacheFree(CacheEntry *e) {
+    if (e->path) unlink(e->path);
+    free(e->path);
+    free(e->key);
+    free(e->digest.crcs);
+    free(e);
+}
+
+// Drops unreferenced entries idle past the TTL, then least recently used ones until the
+// archives fit the budget. Called with the cache lock held. Entries from stale generations can
+// no longer be hit by their query, but stay until then so interrupted downloads can resume;
+// an empty or failed one is of no use to anybody and goes at once.
+static void cacheEvict(void) {
+    CacheEntry *e = archiveCache.tail;
+    time_t now = cacheNow();
+    while (e) {
+        CacheEntry *prev = e->prev;
+        if (e->refs == 0 && e->state != CACHE_BUILDING &&
+            ((e->generation != archiveCache.generation && e->state != CACHE_READY) ||
+             archiveCache.bytes > archiveCache.budget || now - e->lastUsed >= archiveCache.ttl)) {
+            cacheUnlink(e);
+            archiveCache.bytes -= e->size;
+            cacheFree(e);
+        }
+        e = prev;
+    }
+}
+
+// Finds or creates the entry for key at the given generation and takes a reference on it.
+// Sets *builder when the caller created the entry and must pack the archive.
+static CacheEntry *cacheAcquire(const char *key, unsigned long generation, int *builder) {
+    pthread_mutex_lock(&archiveCache.lock);
+    if (generation > archiveCache.generation) archiveCache.generation = generation;
+    cacheEvict();
+    CacheEntry *e = archiveCache.head;
+    while (e && (e->generation != generation || strcmp(e->key, key) != 0)) e = e->next;
+    *builder = 0;
+    if (e) {
+        cacheUnlink(e);
+        cachePushFront(e);
+    } else if ((e = calloc(1, sizeof(CacheEntry))) && (e->key = strdup(key))) {
+        e->generation = generation;
+        e->state = CACHE_BUILDING;
+        cachePushFront(e);
+        *builder = 1;
+    } else {
+        free(e);
+        e = NULL;
+    }
+    if (e) {
+        e->refs++;
+        e->lastUsed = cacheNow();
+    }
+    pthread_mutex_unlock(&archiveCache.lock);
+    return e;
+}
+
+// Takes a reference on the finished archive with the given content id, whatever its generation.
+// Returns NULL when no such archive is cached any more.
+static CacheEntry *cacheAcquireId(uint64_t contentId) {
+    pthread_mutex_lock(&archiveCache.lock);
+    CacheEntry *e = archiveCache.head;
+    while (e && (e->state != CACHE_READY || e->digest.contentId != contentId)) e = e->next;
+    if (e) {
+        cacheUnlink(e);
+        cachePushFront(e);
+        e->refs++;
+        e->lastUsed = cacheNow();
+    }
+    pthread_mutex_unlock(&archiveCache.lock);
+    return e;
+}
+
+// Waits until another worker finishes the entry and returns its final state
+static CacheState cacheWait(CacheEntry *e) {
+    pthread_mutex_lock(&archiveCache.lock);
+    while (e->state == CACHE_BUILDING) pthread_cond_wait(&archiveCache.built, &archiveCache.lock);
+    CacheState state = e->state;
+    pthread_mutex_unlock(&archiveCache.lock);
+    return state;
+}
+
+// Publishes the builder's result and wakes the requests waiting for it.
+// The entry takes over path and the CRC array of digest.
+static void cachePublish(CacheEntry *e, CacheState state, char *path, off_t size, unsigned long long rawSize,
+                         const ArchiveDigest *digest) {
+    pthread_mutex_lock(&archiveCache.lock);
+    e->state = state;
+    e->path = path;
+    e->size = size;
+    e->rawSize = rawSize;
+    if (digest) e->digest = *digest;
+    if (state == CACHE_FAILED) cacheUnlink(e);
+    else archiveCache.bytes += size;
+    pthread_cond_broadcast(&archiveCache.built);
+    pthread_mutex_unlock(&archiveCache.lock);
+}
+
+// Drops a reference. A sender keeps its own descriptor, so eviction may unlink the file meanwhile.
+static void cacheRelease(CacheEntry *e) {
+    pthread_mutex_lock(&archiveCache.lock);
+    e->refs--;
+    e->lastUsed = cacheNow();
+    if (e->state == CACHE_FAILED && e->refs == 0) cacheFree(e);
+    else if (archiveCache.bytes > archiveCache.budget) cacheEvict();
+    pthread_mutex_unlock(&archiveCache.lock);
+}
+
+// Removes cache files left behind by server processes that are no longer running.
+// At startup includeSelf also clears files of an earlier process that had our pid.
+static void cacheSweep(const char *cacheDir, int includeSelf) {
+    DIR *dir = opendir(cacheDir);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        long pid = strtol(entry->d_name, &end, 10);
+        if (end == entry->d_name || *end != '-') continue;
+        if ((includeSelf && pid == getpid()) || (pid != getpid() && kill(pid, 0) < 0 && errno == ESRCH))
+            unlinkat(dirfd(dir), entry->d_name, 0);
     }
     closedir(dir);
+}
 
-    qsort(directories, dirCount, sizeof(DirEntry), timeSort);
-
-    for (int i = 0; i < dirCount; i++) {
-        strftime(timeBuff, sizeof(timeBuff), "%Y-%m-%d %H:%M:%S", localtime(&directories[i].mod_time));
-        snprintf(buffer, sizeof(buffer), "%-30s %s\n", timeBuff, directories[i].name);
-        sendData(client_sock_fd, buffer);
-        free(directories[i].name);
+// Background reclamation: archives idle past the TTL, built from an outdated tree or over the
+// budget are removed even when no request comes along to evict them, and so are files left by
+// server processes that died. Wakes at least every CACHE_RECLAIM_INTERVAL seconds.
+static void *cacheReclaimMain(void *arg) {
+    const char *cacheDir = arg;
+    while (1) {
+        pthread_mutex_lock(&archiveCache.lock);
+        time_t pause = archiveCache.ttl / 2;
+        cacheEvict();
+        pthread_mutex_unlock(&archiveCache.lock);
+        cacheSweep(cacheDir, 0);
+        sleep(pause < 1 ? 1 : pause > CACHE_RECLAIM_INTERVAL ? CACHE_RECLAIM_INTERVAL : pause);
     }
-
-    sendData(client_sock_fd, "END\n");
+    return NULL;
 }
-// Function to list directories alphabetically
-void listDirectoriesAlphabetically(int client_sock_fd) {
-    DIR* dir;
-    struct dirent* entry;
-    char* directories[MAX_DIRS];
-    int dirCount = 0;
-    char buffer[BUFFER_SIZE];
 
-    if ((dir = opendir(getenv("HOME"))) == NULL) {
-        sendData(client_sock_fd, "Failed to open directory.\n");
+// packIndexedFiles flags
+enum {
+    PACK_SYNC = 1,  // w24sync: members keep their path below the root, and no match is no error
+};
+
+// Packs every indexed file selected by query into an archive in the request's codec and sends
+// it. queryKey is the normalized query; identical queries in the same codec against an unchanged
+// tree reuse the cached archive.
+void packIndexedFiles(Request *req, const char *queryKey, IndexQuery query, const void *arg, int flags) {
+    char w24projectDir[BUFFER_SIZE];
+    char cacheDir[BUFFER_SIZE + 8];
+    char path[PATH_MAX];
+    char codec[16];
+    size_t rootLen = 0;
+    StringList matches = { .arena = req->arena };
+    int builder = 0;
+    int outOfMemory = 0;
+    unsigned long long rawSize = 0;
+    ArchiveDigest digest = { 0, NULL, 0 };
+
+    char key[MAX_REQUEST_PAYLOAD + 32];
+    codecLabel(req, codec, sizeof(codec));
+    snprintf(key, sizeof(key), "%s -z %s%s", queryKey, codec, req->part ? " -p" : "");
+
+    snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", getenv("HOME") ? getenv("HOME") : ".");
+    snprintf(cacheDir, sizeof(cacheDir), "%s/cache", w24projectDir);
+
+    // Create w24project directory if it does not exist
+    if (createDirectory(w24projectDir) != 0 || createDirectory(cacheDir) != 0) {
+        sendError(req, "Failed to create project directory.\n");
         return;
     }
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_DIR) {
-            directories[dirCount++] = strdup(entry->d_name);
-            if (dirCount >= MAX_DIRS) break;
+    // A resume names the archive it continues by content id. While that is still cached it is
+    // sent on as is, even if the tree changed since; otherwise the query runs afresh.
+    uint64_t filterStart = statsClock();
+    CacheEntry *entry = req->resumeId ? cacheAcquireId(req->resumeId) : NULL;
+
+    // The generation and the snapshot of matching paths come from the same read lock,
+    // so a cached archive always reflects exactly the tree its key names
+    if (!entry) {
+        pthread_rwlock_rdlock(&indexLock);
+        entry = cacheAcquire(key, fileIndex.generation, &builder);
+        IdList selected = { NULL, 0, 0 };
+        rootLen = strlen(fileIndex.dirs[0].path);
+        if (builder && query(arg, &selected) == 0) {
+            for (size_t i = 0; i < selected.count; i++) {
+                indexFilePath(&fileIndex.files[selected.ids[i]], path, sizeof(path));
+                if (stringListAdd(&matches, path) < 0) {
+                    outOfMemory = 1;
+                    break;
+                }
+            }
         }
+        pthread_rwlock_unlock(&indexLock);
+        free(selected.ids);
     }
-    closedir(dir);
+    statPhase(req, PHASE_FILTER, filterStart);
 
-    qsort(directories, dirCount, sizeof(char*), alphaSort);
-
-    for (int i = 0; i < dirCount; i++) {
-        snprintf(buffer, sizeof(buffer), "%s\n", directories[i]);
-        sendData(client_sock_fd, buffer);
-        free(directories[i]);  // Free the duplicated string
+    if (!entry) {
+        sendError(req, "Failed to pack files into tar.\n");
+        return;
+    }
+    // A partial match list must not be packed, let alone cached under the full query's key
+    if (outOfMemory) {
+        cachePublish(entry, CACHE_FAILED, NULL, 0, 0, NULL);
+        cacheRelease(entry);
+        sendError(req, "Out of memory\n");
+        return;
     }
 
-    sendData(client_sock_fd, "END\n");
-}
-
-
-// New function to create the w24project directory and check for errors
-int createDirectory(const char *dir) {
-    struct stat st = {0};
+    CacheState state;
+    if (builder && matches.count == 0) {
+        cachePublish(entry, state = CACHE_EMPTY, NULL, 0, 0, NULL);
+    } else if (builder) {
+        // Stream every match through the archive writer, storing each under its basename, or
+        // for a sync under its path below the root
+        int status = -1;
+        char *tarFilePath = NULL;
+        struct stat tarStat;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_mutex_lock(&archiveCache.lock);
+        unsigned long seq = archiveCache.seq++;
+        pthread_mutex_unlock(&archiveCache.lock);
+        if (asprintf(&tarFilePath, "%s/%ld-%lu%s", cacheDir, (long)getpid(), seq, req->codec->suffix) < 0)
+            tarFilePath = NULL;
+        int tarFd = tarFilePath ? open(tarFilePath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+        ArchiveWriter *aw = tarFd >= 0 ? archiveOpen(tarFd, req->codec, req->level) : NULL;
+        if (aw) {
+            aw->part = req->part;
+            for (size_t i = 0; i < matches.count && !aw->failed; i++) {
+                const char *match = stringListGet(&matches, i);
+                archiveAddFile(aw, match, flags & PACK_SYNC ? match + rootLen + 1 : strrchr(match, '/') + 1);
+            }
+            status = archiveClose(aw, &rawSize, &digest);
+        }
+        if (status == 0 && fstat(tarFd, &tarStat) < 0) {
+            free(digest.crcs);
+            status = -1;
+        }
+        if (tarFd >= 0) close(tarFd);
 
-    if (stat(dir, &st) == -1) {
-        if (mkdir(dir, 0777) != 0) {
-            return -1;  // Return an error if directory creation fails
+        if (status == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            printf("Packed '%s': %llu -> %lld bytes, ratio %.2f, %.1f MB/s\n", key, rawSize,
+                   (long long)tarStat.st_size, tarStat.st_size > 0 ? (double)rawSize / tarStat.st_size : 0.0,
+                   secs > 0 ? rawSize / secs / 1e6 : 0.0);
+            statRecord(req->stat, PHASE_COMPRESS, (uint64_t)(secs * 1e6));
+            atomic_fetch_add_explicit(&stats.archivesBuilt, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&stats.archiveRawBytes, rawSize, memory_order_relaxed);
+            atomic_fetch_add_explicit(&stats.archiveBytes, tarStat.st_size, memory_order_relaxed);
+            cachePublish(entry, state = CACHE_READY, tarFilePath, tarStat.st_size, rawSize, &digest);
+        } else {
+            if (tarFilePath) unlink(tarFilePath);
+            free(tarFilePath);
+            cachePublish(entry, state = CACHE_FAILED, NULL, 0, 0, NULL);
         }
+    } else {
+        state = cacheWait(entry);
     }
-    return 0;  // Return success if directory exists or was created successfully
-}
-
-// New function to handle the creation of tar.gz file
-int createTarFile(const char *dir, const char *tarName) {
-    char command[BUFFER_SIZE];
-    snprintf(command, sizeof(command), "tar -czf %s/%s -C %s .", dir, tarName, dir);
+    // Open and copy the checksums before dropping the reference; both outlive a later eviction
+    int fd = state == CACHE_READY ? open(entry->path, O_RDONLY | O_CLOEXEC) : -1;
+    rawSize = entry->rawSize;
+    digest = entry->digest;
+    digest.crcs = fd >= 0 ? malloc(digest.crcCount * sizeof(uint32_t) + 1) : NULL;
+    if (digest.crcs) {
+        memcpy(digest.crcs, entry->digest.crcs, digest.crcCount * sizeof(uint32_t));
+    } else if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    cacheRelease(entry);
 
-    return system(command);
+    if (state == CACHE_EMPTY && (flags & PACK_SYNC)) {
+        sendData(req, "No files changed.\n");
+    } else if (state == CACHE_EMPTY) {
+        sendError(req, "No matching files found to pack.\n");
+    } else if (fd < 0) {
+        sendError(req, "Failed to pack files into tar.\n");
+    } else {
+        char name[32];
+        snprintf(name, sizeof(name), "%s%s", flags & PACK_SYNC ? "sync" : "temp", req->codec->suffix);
+        // Resume where the client stopped only if it holds the start of these very bytes
+        off_t offset = req->resumeId == digest.contentId ? (off_t)req->resumeOffset : 0;
+        sendArchive(req, fd, name, rawSize, codec, &digest, offset);
+        close(fd);
+    }
+    free(digest.crcs);
 }
 
-// Function to count the number of extensions and check for duplicates
-int validateExtensions(const char *extensions, int *count) {
-    char extCopy[BUFFER_SIZE];
-    char *token;
-    char *extensionsArray[3] = {NULL, NULL, NULL}; // Supports up to 3 extensions
+// Returns non-zero if name matches the glob '*.<ext>', ignoring case if the index folds it
+static int nameHasExtension(const char *name, const char *ext) {
+    size_t nameLen = strlen(name), extLen = strlen(ext);
+    if (nameLen <= extLen || name[nameLen - extLen - 1] != '.') return 0;
+    return fileIndex.foldCase ? strcasecmp(name + nameLen - extLen, ext) == 0
+                              : strcmp(name + nameLen - extLen, ext) == 0;
+}
 
-    strncpy(extCopy, extensions, sizeof(extCopy));
-    extCopy[sizeof(extCopy) - 1] = '\0'; // Ensure null-termination
+// Query for 'w24ft': arg is a NULL-terminated list of extensions. Each one is looked up by
+// its last component, so 'tar.gz' reads the 'gz' posting list and keeps the names ending in
+// '.tar.gz'. Posting lists are disjoint, so reading each needed list once gives the union.
+static int extensionQuery(const void *arg, IdList *out) {
+    char *const *exts = arg;
+    int n = 0;
+    while (exts[n]) n++;
+    char (*keys)[NAME_MAX + 1] = malloc(n * sizeof(*keys));
+    if (!keys) return -1;
+    for (int i = 0; i < n; i++) {
+        char dotted[NAME_MAX + 2];
+        snprintf(dotted, sizeof(dotted), ".%s", exts[i]);
+        extensionOf(dotted, keys[i], sizeof(keys[i]), fileIndex.foldCase);
+    }
 
-    *count = 0;
-    token = strtok(extCopy, " ");
-    while (token && *count < 3) {
-        // Check for duplicate extensions
-        for (int i = 0; i < *count; i++) {
-            if (strcmp(extensionsArray[i], token) == 0) {
-                // Duplicate extension found
-                return -1;
-            }
+    int status = 0;
+    for (int i = 0; i < n && status == 0; i++) {
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++) seen = strcmp(keys[j], keys[i]) == 0;
+        IndexExt *list = seen ? NULL : indexFindExt(keys[i], 0);
+        for (int k = 0; list && k < list->count && status == 0; k++) {
+            const IndexFile *f = &fileIndex.files[list->ids[k]];
+            int match = 0;
+            for (int j = i; j < n && !match; j++)
+                match = strcmp(keys[j], keys[i]) == 0 && (!strchr(exts[j], '.') || nameHasExtension(f->name, exts[j]));
+            if (match) status = idListPush(out, list->ids[k]);
         }
-        extensionsArray[*count] = token;
-        (*count)++;
-        token = strtok(NULL, " ");
     }
-    if (token) { // More than 3 extensions provided
-        return -2;
-    }
-    if (*count == 0) { // No extensions provided
-        return -3;
-    }
-    return 0; // All good
+    free(keys);
+    return status;
 }
 
-void packFilesByExtension(int client_sock_fd, const char *extensions) {
-    char w24projectDir[BUFFER_SIZE];
-    char tarFilePath[BUFFER_SIZE];
-    char command[BUFFER_SIZE * 6];
-    char extensionsCopy[BUFFER_SIZE]; // Mutable copy of extensions
+void packFilesByExtension(Request *req, char *extensions) {
+    char *extList[MAX_EXTENSIONS + 1];
     int extCount;
-    int validationResult = validateExtensions(extensions, &extCount);
+    int validationResult = validateExtensions(extensions, extList, &extCount);
     char notification[BUFFER_SIZE];
 
     // Check validation result and respond appropriately
     switch (validationResult) {
         case -1:
             snprintf(notification, sizeof(notification), "Error: Duplicate file types provided.\n");
-            write(client_sock_fd, notification, strlen(notification));
-            return;
-        case -2:
-            snprintf(notification, sizeof(notification), "Error: Number of extensions greater than the limit.\n");
-            write(client_sock_fd, notification, strlen(notification));
+            sendError(req, notification);
             return;
         case -3:
             snprintf(notification, sizeof(notification), "Error: No file extensions provided.\n");
-            write(client_sock_fd, notification, strlen(notification));
+            sendError(req, notification);
             return;
     }
+    extList[extCount] = NULL;
 
-    // Copy the extensions to a mutable string
-    strncpy(extensionsCopy, extensions, sizeof(extensionsCopy));
-    extensionsCopy[sizeof(extensionsCopy) - 1] = '\0'; // Ensure null-termination
+    // Order does not change the result, so 'w24ft txt c' shares the cache entry of 'w24ft c txt'
+    char key[MAX_REQUEST_PAYLOAD + 8] = "w24ft";
+    char *sorted[MAX_EXTENSIONS];
+    memcpy(sorted, extList, extCount * sizeof(char *));
+    qsort(sorted, extCount, sizeof(char *), stringSort);
+    for (int i = 0; i < extCount; i++) {
+        strcat(key, " ");
+        strcat(key, sorted[i]);
+    }
+    if (fileIndex.foldCase)
+        for (char *p = key; *p; p++) *p = tolower((unsigned char)*p);
+    packIndexedFiles(req, key, extensionQuery, extList, 0);
+}
 
-    snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", getenv("HOME") ? getenv("HOME") : ".");
-    snprintf(tarFilePath, sizeof(tarFilePath), "%s/temp.tar.gz", w24projectDir);
+#define NAME_BATCH (64 * 1024)  // w24fn reply bytes formatted per hold of the index lock
+#define NAME_RECORD (PATH_MAX + 128)  // Room for one w24fn record
 
-    // Create w24project directory if it does not exist
-    if (createDirectory(w24projectDir) != 0) {
-        write(client_sock_fd, "Failed to create project directory.\n", 35);
-        return;
-    }
+// Formats the w24fn record of one file; records after the first are set apart by a blank line
+static int formatNameMatch(char *buf, size_t len, size_t index, const char *path, off_t size, time_t mtime, mode_t mode) {
+    char timebuff[64];
+    struct tm tmBuf;
+    strftime(timebuff, sizeof(timebuff), "%Y-%m-%d %H:%M:%S", localtime_r(&mtime, &tmBuf));
+    return snprintf(buf, len, "%sFilename: %s\nSize: %ld bytes\nDate modified: %s\nPermissions: %o\n",
+                    index > 0 ? "\n" : "", path, (long)size, timebuff, mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+}
 
-    // Cleanup previous tar file if exists
-    unlink(tarFilePath);
+// A w24fn walk, whose walker threads send each match as they find it
+typedef struct {
+    Request *req;
+    const char *name;
+    int all;                // Report every match instead of stopping at the first
+    pthread_mutex_t lock;   // Serializes the walker threads' replies
+    size_t count;           // Matches sent so far
+} NameSearch;
 
-    // Start building the find command
-    strcpy(command, "find ~ -type f \\( ");
+// Walk visitor for w24fn; unless every match is wanted, the first one cancels the walk
+static int nameSearchVisit(const WalkEntry *entry, long *childTag, void *arg) {
+    NameSearch *search = arg;
+    (void)childTag;
+    if (entry->type == DT_DIR) return strcmp(entry->path, fileIndex.skipPath) == 0 ? WALK_SKIP : WALK_CONTINUE;
 
-    // Tokenize the mutable copy of extensions and build the rest of the find command
-    char *token = strtok(extensionsCopy, " ");
-    while (token) {
-        strcat(command, "-name '*.");
-        strcat(command, token);
-        strcat(command, "' ");
-        token = strtok(NULL, " ");
-        if (token) {
-            strcat(command, "-o "); // OR operator for multiple extensions
-        }
+    struct stat sb;
+    char path[PATH_MAX], record[NAME_RECORD];
+    if (entry->type != DT_REG || strcmp(entry->name, search->name) != 0 ||
+        fstatat(entry->dirFd, entry->name, &sb, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(sb.st_mode))
+        return WALK_CONTINUE;
+    snprintf(path, sizeof(path), "%s/%s", entry->dirPath, entry->name);
+    pthread_mutex_lock(&search->lock);
+    if (search->all || search->count == 0) {
+        formatNameMatch(record, sizeof(record), search->count++, path, sb.st_size, sb.st_mtime, sb.st_mode);
+        sendData(search->req, record);
     }
+    pthread_mutex_unlock(&search->lock);
+    return search->all ? WALK_CONTINUE : WALK_STOP;
+}
 
-    // Finish building the find command to print null-terminated strings
-    strcat(command, "\\) -print0 | tar --null -T - --transform 's/.*\\///' -czvf ");
-    strcat(command, tarFilePath);
+// Handles 'w24fn [-a] <filename>': details of one file with that basename, or of all of them.
+// Matches are sent as they are formatted, a batch per hold of the index lock, so the reply
+// never has to fit in memory at once; only the ids of the matches are collected up front.
+void sendFileInfo(Request *req, const char *filename, int all) {
+    char root[PATH_MAX], path[PATH_MAX];
+    NameSearch search = { .req = req, .name = filename, .all = all, .lock = PTHREAD_MUTEX_INITIALIZER };
+    IdList ids = { NULL, 0, 0 };
 
-    // Execute the command
-    int result = system(command);
-    if (result != 0) {
-        write(client_sock_fd, "Failed to find and pack files.\n", 30);
-        return;
+    // The interned name heads the chain of every file with that basename. Without complete
+    // inotify coverage the index may miss files, so w24fn -a then searches the live tree only.
+    uint64_t phaseStart = statsClock();
+    pthread_rwlock_rdlock(&indexLock);
+    int stale = fileIndex.stale;
+    IndexName *interned = stale && all ? NULL : indexFindName(filename);
+    for (int id = interned ? interned->firstFile : -1; id >= 0 && (all || ids.count == 0);
+         id = fileIndex.files[id].nextSame) {
+        if (idListPush(&ids, id) < 0) break;
     }
+    snprintf(root, sizeof(root), "%s", fileIndex.dirs[0].path);
+    pthread_rwlock_unlock(&indexLock);
+    statPhase(req, PHASE_FILTER, phaseStart);
 
-    // Check if tar file has been created and is not empty
-    struct stat tarStat;
-    if (stat(tarFilePath, &tarStat) == -1 || tarStat.st_size == 0) {
-        write(client_sock_fd, "No matching files found to pack.\n", 32);
+    // A file may go away between batches; only those still indexed under the name are sent
+    char *batch = ids.count > 0 ? malloc(NAME_BATCH) : NULL;
+    for (size_t next = 0; batch && next < ids.count; ) {
+        size_t len = 0;
+        pthread_rwlock_rdlock(&indexLock);
+        for (; next < ids.count && NAME_BATCH - len >= NAME_RECORD; next++) {
+            const IndexFile *f = &fileIndex.files[ids.ids[next]];
+            if (!f->live || strcmp(f->name, filename) != 0) continue;
+            indexFilePath(f, path, sizeof(path));
+            len += formatNameMatch(batch + len, NAME_BATCH - len, search.count++, path, f->size, f->mtime, f->mode);
+        }
+        pthread_rwlock_unlock(&indexLock);
+        if (len > 0) sendData(req, batch);
+    }
+    if (ids.count > 0 && !batch) {
+        sendError(req, "Out of memory\n");
+        free(ids.ids);
         return;
     }
+    free(batch);
+    free(ids.ids);
 
-    // Notify the client of successful tar file creation
-    // char notification[BUFFER_SIZE];
-    snprintf(notification, sizeof(notification), "Files packed into %s\n", tarFilePath);
-    write(client_sock_fd, notification, strlen(notification));
-}
-
-// Function to be called by nftw for each encountered file
-static int file_info(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
-    if (typeflag == FTW_F) {
-        // If this is a file and it matches the filename we're looking for...
-        if (strcmp(fpath + ftwbuf->base, fileInfo.path) == 0) { // Corrected the usage here
-            fileInfo.found = 1; // Mark as found
-            snprintf(fileInfo.path, sizeof(fileInfo.path), "%s", fpath); // Copy full path
-            return 1; // Stop walking the tree
-        }
+    if (stale && (all || search.count == 0)) {
+        phaseStart = statsClock();
+        walkTree(root, 0, nameSearchVisit, &search, walkThreads());
+        statPhase(req, PHASE_WALK, phaseStart);
     }
-    return 0; // Continue walking the tree
-}
 
-void sendFileInfo(int client_sock_fd, char *filename) {
-    char buffer[BUFFER_SIZE * 2];
-    char timebuff[256];
-    struct stat file_stat;
-
-    // Reset found flag and copy filename into global fileInfo structure
-    fileInfo.found = 0;  
-    strncpy(fileInfo.path, filename, BUFFER_SIZE);
-
-    // Walk through the file tree starting at the user's home directory
-    nftw(getenv("HOME"), file_info, 20, FTW_PHYS);
-
-    if (fileInfo.found) {
-        // If file is found, stat it to get its information
-        if (stat(fileInfo.path, &file_stat) == 0) {
-            strftime(timebuff, sizeof(timebuff), "%Y-%m-%d %H:%M:%S", localtime(&file_stat.st_mtime));
-            snprintf(buffer, sizeof(buffer), "Filename: %s\nSize: %ld bytes\nDate modified: %s\nPermissions: %o\n",
-                     fileInfo.path, file_stat.st_size, timebuff, file_stat.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
-            write(client_sock_fd, buffer, strlen(buffer));
-        } else {
-            // If stat fails after finding the file
-            snprintf(buffer, sizeof(buffer), "Error retrieving file info\n");
-            write(client_sock_fd, buffer, strlen(buffer));
-        }
-    } else {
+    if (search.count == 0) {
         // If the file wasn't found
-        snprintf(buffer, sizeof(buffer), "File not found\n");
-        write(client_sock_fd, buffer, strlen(buffer));
+        sendError(req, "File not found\n");
     }
+}
 
-    // End signal to indicate message completion
-    snprintf(buffer, sizeof(buffer), "END\n");
-    write(client_sock_fd, buffer, strlen(buffer));
+// Query for 'w24fz': sizes strictly between size1 and size2, like find -size +Nc -size -Mc.
+// Two binary searches on the size index, then only the matches are touched.
+static int sizeQuery(const void *arg, IdList *out) {
+    const struct fileInfo *range = arg;
+    if (range->size2 - range->size1 < 2) return 0;
+    return orderedRange(&fileIndex.bySize, (int64_t)range->size1 + 1, (int64_t)range->size2 - 1, out);
 }
 
 // Function to handle the 'w24fz' command
-void packFilesBySize(int client_sock_fd, long size1, long size2) {
-    char w24projectDir[BUFFER_SIZE];
-    char fileListPath[BUFFER_SIZE];
-    char tarFilePath[BUFFER_SIZE];
-    FILE *fp;
-    int status;
+void packFilesBySize(Request *req, long size1, long size2) {
+    struct fileInfo range = { .size1 = size1, .size2 = size2 };
+    char key[64];
+    snprintf(key, sizeof(key), "w24fz %ld %ld", size1, size2);
+    packIndexedFiles(req, key, sizeQuery, &range, 0);
+}
 
-    snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", getenv("HOME") ? getenv("HOME") : ".");
-    snprintf(fileListPath, sizeof(fileListPath), "%s/filelist.txt", w24projectDir);
-    snprintf(tarFilePath, sizeof(tarFilePath), "%s/temp.tar.gz", w24projectDir);
+// Parses a YYYY-MM-DD date into local midnight
+static time_t parseDate(const char *date) {
+    struct tm given_date;
+    memset(&given_date, 0, sizeof(struct tm));
+    strptime(date, "%Y-%m-%d", &given_date);
+    given_date.tm_isdst = -1;  // Let mktime decide, or midnight is an hour off in summer
+    return mktime(&given_date);
+}
 
-    // Create w24project directory if it does not exist
-    if (createDirectory(w24projectDir) != 0) {
-        write(client_sock_fd, "Failed to create project directory.\n", 35);
-        return;
-    }
+// Queries for 'w24fdb' (mtime at or before the cutoff) and 'w24fda' (at or after it),
+// each a single range of the mtime index. Keys are nanoseconds, so a file modified
+// half a second after midnight is not 'before' that midnight.
+static int olderQuery(const void *arg, IdList *out) {
+    return orderedRange(&fileIndex.byMtime, INT64_MIN, (int64_t)*(const time_t *)arg * 1000000000, out);
+}
+
+static int newerQuery(const void *arg, IdList *out) {
+    return orderedRange(&fileIndex.byMtime, (int64_t)*(const time_t *)arg * 1000000000, INT64_MAX, out);
+}
+
+// Function to handle the 'w24fdb <date>' command
+void packFilesByDate(Request *req, const char *date) {
+    time_t given_time = parseDate(date);
+    char key[64];
+    snprintf(key, sizeof(key), "w24fdb %lld", (long long)given_time);
+    packIndexedFiles(req, key, olderQuery, &given_time, 0);
+}
+
+// Function to handle the 'w24fda <date>' command
+void packFilesByDateGreat(Request *req, const char *date) {
+    time_t given_time = parseDate(date);
+    char key[64];
+    snprintf(key, sizeof(key), "w24fda %lld", (long long)given_time);
+    packIndexedFiles(req, key, newerQuery, &given_time, 0);
+}
 
-    // Cleanup previous files if exist
-    unlink(tarFilePath);
-    unlink(fileListPath);
+// Changes a w24sync covers: the journal from seq from on, within the given epoch.
+// from is SYNC_ALL for a sync without a token.
+#define SYNC_ALL UINT64_MAX
+typedef struct {
+    uint64_t epoch;
+    uint64_t from;
+} SyncRange;
+
+// Query for 'w24sync': files created or modified within the range, found by walking the journal
+// rather than the tree. A record counts only while it is its file's latest change, so every file
+// comes up once. Without a token, or once the range is gone because the journal wrapped or the
+// index was rebuilt since the token was checked, every file is selected.
+static int syncQuery(const void *arg, IdList *out) {
+    const SyncRange *range = arg;
+    if (range->from != SYNC_ALL && range->epoch == changeJournal.epoch &&
+        changeJournal.next - range->from <= CHANGE_JOURNAL_SIZE) {
+        for (uint64_t seq = range->from; seq < changeJournal.next; seq++) {
+            const ChangeRecord *r = &changeJournal.ring[seq % CHANGE_JOURNAL_SIZE];
+            if (r->id >= 0 && fileIndex.files[r->id].live && fileIndex.files[r->id].version == r->version &&
+                idListPush(out, r->id) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    for (int id = 0; id < fileIndex.fileCount; id++)
+        if (fileIndex.files[id].live && idListPush(out, id) < 0) return -1;
+    return 0;
+}
 
-    // Find command to locate files within the specified size range and output to a file list
-    char findCommand[BUFFER_SIZE * 3];
-    snprintf(findCommand, sizeof(findCommand),
-             "find ~ -type f \\( -size +%ldc -a -size -%ldc \\) -print > %s",
-             size1, size2, fileListPath);
+// Function to handle the 'w24sync [token]' command. Replies with a new token, then a 'Deleted:'
+// line for each file removed since the given token, then an archive of the files created or
+// modified since, stored under their paths below the root. Without a token every file is sent.
+// A change landing between the token and the archive may be sent again next time, never lost.
+void syncFiles(Request *req, const char *token) {
+    StringList removed = { .arena = req->arena }, current = { .arena = req->arena };
+    SyncRange range = { 0, SYNC_ALL };
+    unsigned long long epoch = 0, from = 0;
+    int consumed = 0, outOfMemory = 0;
+    char path[PATH_MAX];
 
-    // Execute the find command
-    status = system(findCommand);
-    if (status != 0) {
-        write(client_sock_fd, "Failed to find files or no files found.\n", 38);
+    if (*token && (sscanf(token, "%llx-%llx%n", &epoch, &from, &consumed) != 2 || token[consumed] != '\0')) {
+        sendError(req, "Malformed change token.\n");
         return;
     }
 
-    // Prepare the tar command
-    char tarCommand[BUFFER_SIZE * 3];
-    snprintf(tarCommand, sizeof(tarCommand),
-             "tar --transform 's#.*/##' -czf %s -T %s",
-             tarFilePath, fileListPath);
+    // Removals come straight from the journal; a path that exists again by now is not deleted
+    pthread_rwlock_rdlock(&indexLock);
+    uint64_t next = changeJournal.next;
+    range.epoch = changeJournal.epoch;
+    int expired = *token && (epoch != changeJournal.epoch || from > next || next - from > CHANGE_JOURNAL_SIZE);
+    if (*token && !expired) {
+        range.from = from;
+        size_t rootLen = strlen(fileIndex.dirs[0].path);
+        for (uint64_t seq = from; seq < next && !outOfMemory; seq++) {
+            const ChangeRecord *r = &changeJournal.ring[seq % CHANGE_JOURNAL_SIZE];
+            if (r->removed) {
+                outOfMemory = stringListAdd(&removed, r->removed) < 0;
+            } else if (r->id >= 0 && fileIndex.files[r->id].live && fileIndex.files[r->id].version == r->version) {
+                indexFilePath(&fileIndex.files[r->id], path, sizeof(path));
+                outOfMemory = stringListAdd(&current, path + rootLen + 1) < 0;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&indexLock);
 
-    // Execute the tar command
-    status = system(tarCommand);
-    if (status != 0) {
-        write(client_sock_fd, "Failed to pack files into tar.\n", 30);
+    if (expired) {
+        sendError(req, "Change token expired; run 'w24sync' without a token for a full sync.\n");
+        return;
+    }
+    // A dropped removal would leave the client holding a deleted file for good
+    if (outOfMemory) {
+        sendError(req, "Out of memory\n");
         return;
     }
 
-    // Notify the client of successful tar file creation
-    char notification[BUFFER_SIZE];
-    snprintf(notification, sizeof(notification), "Files packed into %s\n", tarFilePath);
-    write(client_sock_fd, notification, strlen(notification));
-}
+    char line[PATH_MAX + 16];
+    snprintf(line, sizeof(line), "Token: %llx-%llx\n", (unsigned long long)range.epoch, (unsigned long long)next);
+    sendData(req, line);
+
+    const char **gone = arenaAlloc(req->arena, (removed.count + current.count) * sizeof(char *) + 1);
+    if (gone) {
+        const char **present = gone + removed.count;
+        for (size_t i = 0; i < removed.count; i++) gone[i] = stringListGet(&removed, i);
+        for (size_t i = 0; i < current.count; i++) present[i] = stringListGet(&current, i);
+        qsort(gone, removed.count, sizeof(char *), stringSort);
+        qsort(present, current.count, sizeof(char *), stringSort);
+        size_t j = 0;
+        for (size_t i = 0; i < removed.count; i++) {
+            if (i > 0 && strcmp(gone[i], gone[i - 1]) == 0) continue;
+            while (j < current.count && strcmp(present[j], gone[i]) < 0) j++;
+            if (j < current.count && strcmp(present[j], gone[i]) == 0) continue;
+            snprintf(line, sizeof(line), "Deleted: %s\n", gone[i]);
+            sendData(req, line);
+        }
+    }
 
-// Helper function to check if file's modification date is less than or equal to given date
-int isFileOlderThan(struct stat *file_stat, struct tm *given_date) {
-    struct tm *file_date = gmtime(&(file_stat->st_mtime)); // Convert to GMT for comparison
-    return difftime(mktime(file_date), mktime(given_date)) <= 0;
+    char key[64];
+    if (range.from == SYNC_ALL)
+        snprintf(key, sizeof(key), "w24sync");
+    else
+        snprintf(key, sizeof(key), "w24sync %llx-%llx", (unsigned long long)range.epoch, (unsigned long long)range.from);
+    packIndexedFiles(req, key, syncQuery, &range, PACK_SYNC);
 }
 
-// Function to handle the 'w24fdb <date>' command
-void packFilesByDate(int client_sock_fd, const char *date) {
-    char w24projectDir[BUFFER_SIZE];
-    char fileListPath[BUFFER_SIZE];
-    char tarFilePath[BUFFER_SIZE];
-    FILE *fp;
-    int status;
 
-    snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", getenv("HOME") ? getenv("HOME") : ".");
-    snprintf(fileListPath, sizeof(fileListPath), "%s/filelist.txt", w24projectDir);
-    snprintf(tarFilePath, sizeof(tarFilePath), "%s/temp.tar.gz", w24projectDir);
+// Renders every metric, either as 'key value' lines for the stats command or in the
+// Prometheus text exposition format. Returns a malloc'd string, NULL if out of memory.
+static char *statsFormat(int prometheus) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) return NULL;
 
-    // Create w24project directory if it does not exist
-    if (createDirectory(w24projectDir) != 0) {
-        write(client_sock_fd, "Failed to create project directory.\n", 35);
-        return;
+    pthread_mutex_lock(&archiveCache.lock);
+    long long cacheBytes = archiveCache.bytes;
+    pthread_mutex_unlock(&archiveCache.lock);
+    pthread_rwlock_rdlock(&indexLock);
+    int indexedFiles = fileIndex.liveFiles;
+    pthread_rwlock_unlock(&indexLock);
+
+    struct { const char *name, *help, *type; unsigned long long value; } scalars[] = {
+        { "open_connections", "Client connections being served", "gauge", atomic_load(&openConnections) },
+        { "active_requests", "Requests running on a worker", "gauge", atomic_load(&activeRequests) },
+        { "queued_requests", "Requests waiting for a worker", "gauge", atomic_load(&queuedRequests) },
+        { "cache_bytes", "Bytes of cached archives on disk", "gauge", cacheBytes },
+        { "indexed_files", "Files in the metadata index", "gauge", indexedFiles },
+        { "archives_built_total", "Archives compressed on cache misses", "counter", atomic_load(&stats.archivesBuilt) },
+        { "archive_raw_bytes_total", "Tar bytes fed to the compressor", "counter", atomic_load(&stats.archiveRawBytes) },
+        { "archive_bytes_total", "Compressed archive bytes written", "counter", atomic_load(&stats.archiveBytes) },
+    };
+    for (size_t i = 0; i < sizeof(scalars) / sizeof(scalars[0]); i++) {
+        if (prometheus)
+            fprintf(out, "# HELP w24_%s %s\n# TYPE w24_%s %s\nw24_%s %llu\n", scalars[i].name, scalars[i].help,
+                    scalars[i].name, scalars[i].type, scalars[i].name, scalars[i].value);
+        else
+            fprintf(out, "%s %llu\n", scalars[i].name, scalars[i].value);
     }
 
-    // Cleanup previous files if exist
-    unlink(tarFilePath);
-    unlink(fileListPath);
+    struct { const char *name, *help; atomic_ullong *values; } counters[] = {
+        { "requests_total", "Requests served", stats.requests },
+        { "request_errors_total", "Requests answered with an error", stats.errors },
+        { "reply_bytes_total", "Reply payload bytes sent", stats.bytes },
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        if (prometheus)
+            fprintf(out, "# HELP w24_%s %s\n# TYPE w24_%s counter\n", counters[i].name, counters[i].help, counters[i].name);
+        for (int c = 0; c < STAT_COMMANDS; c++) {
+            unsigned long long v = atomic_load_explicit(&counters[i].values[c], memory_order_relaxed);
+            if (prometheus) fprintf(out, "w24_%s{command=\"%s\"} %llu\n", counters[i].name, statCommandNames[c], v);
+            else if (v > 0) fprintf(out, "%s %s %llu\n", statCommandNames[c], counters[i].name, v);
+        }
+    }
 
-    // Parse the given date
-    struct tm given_date;
-    memset(&given_date, 0, sizeof(struct tm));
-    strptime(date, "%Y-%m-%d", &given_date);
-    time_t given_time = mktime(&given_date);
-
-    // Execute the find command and write the file names to fileListPath
-    char findCommand[BUFFER_SIZE * 3];
-    snprintf(findCommand, sizeof(findCommand), "find ~ -type f -printf '%%T@ %%p\\n'");
-    fp = popen(findCommand, "r");
-    if (fp == NULL) {
-        write(client_sock_fd, "Failed to execute find command.\n", 31);
-        return;
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    if (prometheus)
+        fprintf(out, "# HELP w24_phase_microseconds Time spent per request in each phase\n"
+                     "# TYPE w24_phase_microseconds summary\n");
+    for (int c = 0; c < STAT_COMMANDS; c++) {
+        for (int ph = 0; ph < STAT_PHASES; ph++) {
+            StatHistogram *h = &stats.latency[c][ph];
+            unsigned long long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+            unsigned long long sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+            if (count == 0) continue;
+            if (prometheus) {
+                const char *labels = statCommandNames[c], *phase = statPhaseNames[ph];
+                for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+                    fprintf(out, "w24_phase_microseconds{command=\"%s\",phase=\"%s\",quantile=\"%g\"} %llu\n",
+                            labels, phase, quantiles[q], (unsigned long long)statQuantile(h, quantiles[q]));
+                fprintf(out, "w24_phase_microseconds_sum{command=\"%s\",phase=\"%s\"} %llu\n", labels, phase, sum);
+                fprintf(out, "w24_phase_microseconds_count{command=\"%s\",phase=\"%s\"} %llu\n", labels, phase, count);
+            } else {
+                fprintf(out, "%s %s count=%llu sum_us=%llu p50_us=%llu p99_us=%llu p999_us=%llu max_us=%llu\n",
+                        statCommandNames[c], statPhaseNames[ph], count, sum,
+                        (unsigned long long)statQuantile(h, 0.5), (unsigned long long)statQuantile(h, 0.99),
+                        (unsigned long long)statQuantile(h, 0.999),
+                        (unsigned long long)atomic_load_explicit(&h->max, memory_order_relaxed));
+            }
+        }
     }
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
 
-    // Open the file list to write
-    FILE *fileList = fopen(fileListPath, "w");
-    if (fileList == NULL) {
-        pclose(fp);
-        write(client_sock_fd, "Failed to create file list.\n", 28);
-        return;
+// Answers 'stats'
+void sendStats(Request *req) {
+    char *text = statsFormat(0);
+    if (text) sendData(req, text);
+    else sendError(req, "Out of memory\n");
+    free(text);
+}
+
+// Serves the Prometheus dump over HTTP on a loopback port (-P), one short connection at a time.
+// It runs on its own thread so a scrape never touches the client event loop.
+static void *metricsMain(void *arg) {
+    int listenFd = *(int *)arg;
+    while (1) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR) sleep(1);
+            continue;
+        }
+        // Read the request head so closing never resets the connection under the reply
+        struct timeval timeout = { .tv_sec = 1 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        char head[4096];
+        size_t got = 0;
+        while (got < sizeof(head) - 1) {
+            ssize_t n = read(fd, head + got, sizeof(head) - 1 - got);
+            if (n <= 0) break;
+            got += n;
+            head[got] = '\0';
+            if (strstr(head, "\r\n\r\n")) break;
+        }
+        char *body = statsFormat(1);
+        char header[128];
+        int headerLen = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                                 body ? "200 OK" : "500 Internal Server Error", body ? strlen(body) : 0);
+        struct iovec iov[2] = { { header, headerLen }, { body, body ? strlen(body) : 0 } };
+        sendvAll(fd, iov, body ? 2 : 1, MSG_NOSIGNAL);
+        free(body);
+        close(fd);
     }
+    return NULL;
+}
 
-    // Read the output from find, parse it, and write to fileList
-    char line[BUFFER_SIZE];
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        double epoch_time;
-        char file_path[BUFFER_SIZE];
-        if (sscanf(line, "%lf %s", &epoch_time, file_path) == 2) {
-            if (epoch_time <= (double)given_time) {
-                fprintf(fileList, "%s\n", file_path);
-            }
+// Handles one command from a client; 'quitc' never gets here, the event loop handles it
+void crequest(Request *req) {
+    char *buffer = req->command;
+    int archive = strncmp(buffer, "w24ft ", 6) == 0 || strncmp(buffer, "w24fz ", 6) == 0 ||
+                  strncmp(buffer, "w24fdb ", 7) == 0 || strncmp(buffer, "w24fda ", 7) == 0 ||
+                  strncmp(buffer, "w24sync ", 8) == 0;
+    if (takeArchiveOptions(req, archive ? strchr(buffer, ' ') + 1 : buffer + strlen(buffer)) < 0) {
+        sendError(req, "Unsupported archive option; 'codecs' lists the codecs this server offers.\n");
+    } else if (strcmp(buffer, "codecs") == 0) {
+        sendCodecs(req);
+    } else if (strcmp(buffer, "stats") == 0) {
+        sendStats(req);
+    } else if (strncmp(buffer, "dirlist -a", 10) == 0) {
+        listDirectoriesAlphabetically(req);
+    } else if (strncmp(buffer, "dirlist -t", 10) == 0) {
+        listDirectoriesByCreationTime(req);
+    } else if (strncmp(buffer, "w24fn ", 6) == 0) { // Check if the command is w24fn
+        char filename[BUFFER_SIZE];
+        int all = strncmp(buffer + 6, "-a ", 3) == 0;  // 'w24fn -a <filename>' lists every match
+        snprintf(filename, sizeof(filename), "%s", buffer + (all ? 9 : 6)); // Extract the filename from the command
+        sendFileInfo(req, filename, all);
+    } else if (strncmp(buffer, "w24ft ", 6) == 0) {
+        char extensions[MAX_REQUEST_PAYLOAD + 1];
+        snprintf(extensions, sizeof(extensions), "%s", buffer + 6); // Extract the extensions part from the command
+        packFilesByExtension(req, extensions);
+    } else if (strncmp(buffer, "w24fz ", 6) == 0) {
+        long size1, size2;
+        sscanf(buffer + 6, "%ld %ld", &size1, &size2); // Extract size1 and size2
+        if(size1 < size2) {
+            packFilesBySize(req, size1, size2);
+        } else {
+            sendError(req, "Error: size1 must be less than size2.\n");
+        }
+    } else if (strncmp(buffer, "w24fdb ", 7) == 0) {
+        // Extract the date string from the command
+        char dateStr[BUFFER_SIZE];
+        snprintf(dateStr, sizeof(dateStr), "%s", buffer + 7);
+
+        // Validate the date format (YYYY-MM-DD)
+        struct tm date;
+        if (strptime(dateStr, "%Y-%m-%d", &date) == NULL) {
+            sendError(req, "Invalid date format.\n");
+        } else {
+            // Call the function to pack files by date
+            packFilesByDate(req, dateStr);
+        }
+    } else if (strncmp(buffer, "w24fda ", 7) == 0) {
+        // Extract the date string from the command
+        char dateStr[BUFFER_SIZE];
+        snprintf(dateStr, sizeof(dateStr), "%s", buffer + 7);
+
+        // Validate the date format (YYYY-MM-DD)
+        struct tm date;
+        if (strptime(dateStr, "%Y-%m-%d", &date) == NULL) {
+            sendError(req, "Invalid date format.\n");
+        } else {
+            // Call the function to pack files by date
+            packFilesByDateGreat(req, dateStr);
         }
+    } else if (strcmp(buffer, "w24sync") == 0 || strncmp(buffer, "w24sync ", 8) == 0) {
+        const char *token = buffer + 7;
+        while (*token == ' ') token++;
+        syncFiles(req, token);
+    } else {
+        sendError(req, "Unsupported operation\n");
     }
-    fclose(fileList);
-    pclose(fp);
 
-    // Prepare the tar command
-    char tarCommand[BUFFER_SIZE * 3];
-    snprintf(tarCommand, sizeof(tarCommand),
-             "tar --transform 's#.*/##' -czf %s -T %s",
-             tarFilePath, fileListPath);
+    // An empty END frame closes every response, so the client never guesses where it stops
+    sendFrame(req, OP_TEXT, FLAG_END, NULL, 0);
+}
 
-    // Execute the tar command
-    status = system(tarCommand);
-    if (status != 0) {
-        write(client_sock_fd, "Failed to pack files into tar.\n", 30);
-        return;
+// Re-arms the one-shot epoll registration so the loop sees the client's next bytes
+static void armConnection(Conn *conn, int op) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+    conn->armed = 1;
+    if (epoll_ctl(epollFd, op, conn->fd, &ev) < 0) {
+        perror("ERROR on epoll_ctl");
+        conn->armed = 0;
+        conn->state = CONN_DRAINING;
     }
+}
 
-    // Notify the client of successful tar file creation
-    char notification[BUFFER_SIZE];
-    snprintf(notification, sizeof(notification), "Files packed into %s\n", tarFilePath);
-    write(client_sock_fd, notification, strlen(notification));
+static void freeConnection(Conn *conn) {
+    close(conn->fd);  // Closing also drops the fd from both epoll sets
+    if (conn->spillFd >= 0) close(conn->spillFd);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_mutex_destroy(&conn->writeLock);
+    free(conn->out);
+    free(conn);
+    atomic_fetch_sub(&openConnections, 1);
 }
 
-// Function to handle the 'w24fdb <date>' command
-void packFilesByDateGreat(int client_sock_fd, const char *date) {
-    char w24projectDir[BUFFER_SIZE];
-    char fileListPath[BUFFER_SIZE];
-    char tarFilePath[BUFFER_SIZE];
-    FILE *fp;
-    int status;
+// Moves one complete request frame out of the input buffer.
+// Returns 1 with *out set when a request is ready, 0 if more bytes are needed and -1 on a protocol violation.
+static int takeRequest(Conn *conn, Request **out) {
+    FrameHeader header;
+    if (conn->inLen < sizeof(header)) return 0;
+    memcpy(&header, conn->in, sizeof(header));
+    if (frameHeaderParse(&header) < 0 || header.opcode != OP_REQUEST || header.length > MAX_REQUEST_PAYLOAD)
+        return -1;
 
-    snprintf(w24projectDir, sizeof(w24projectDir), "%s/w24project", getenv("HOME") ? getenv("HOME") : ".");
-    snprintf(fileListPath, sizeof(fileListPath), "%s/filelist.txt", w24projectDir);
-    snprintf(tarFilePath, sizeof(tarFilePath), "%s/temp.tar.gz", w24projectDir);
+    size_t total = sizeof(header) + header.length;
+    if (conn->inLen < total) return 0;
+    Request *req = malloc(offsetof(Request, command) + header.length + 1);
+    if (!req) return -1;
+    req->conn = conn;
+    req->id = header.id;
+    req->stat = STAT_OTHER;
+    req->failed = 0;
+    req->sendMicros = 0;
+    req->bytesSent = 0;
+    req->next = NULL;
+    memcpy(req->command, conn->in + sizeof(header), header.length);
+    req->command[header.length] = '\0';
+    memmove(conn->in, conn->in + total, conn->inLen - total);
+    conn->inLen -= total;
+    *out = req;
+    return 1;
+}
 
-    // Create w24project directory if it does not exist
-    if (createDirectory(w24projectDir) != 0) {
-        write(client_sock_fd, "Failed to create project directory.\n", 35);
-        return;
+// Hands a request to the worker pool
+static void enqueueJob(Request *req) {
+    pthread_mutex_lock(&jobQueue.lock);
+    if (jobQueue.tail) jobQueue.tail->next = req;
+    else jobQueue.head = req;
+    jobQueue.tail = req;
+    atomic_fetch_add(&queuedRequests, 1);
+    pthread_cond_signal(&jobQueue.ready);
+    pthread_mutex_unlock(&jobQueue.lock);
+}
+
+// Dispatches buffered requests up to the in-flight limit and decides what the connection
+// waits for next. Called with conn->lock held; returns 1 when the caller must free conn.
+static int pumpConnection(Conn *conn) {
+    Request *req;
+    while (conn->state == CONN_READING && conn->inflight < MAX_INFLIGHT && !conn->writing) {
+        int ready = takeRequest(conn, &req);
+        if (ready == 0) break;
+        if (ready < 0) {
+            conn->state = CONN_DRAINING;
+            break;
+        }
+        if (strncmp(req->command, "quitc", 5) == 0) {
+            printf("Client has requested to close the connection.\n");
+            conn->state = CONN_DRAINING;
+            free(req);
+            break;
+        }
+        conn->inflight++;
+        enqueueJob(req);
+    }
+
+    if (conn->state == CONN_READING) {
+        // Stop reading while the client has MAX_INFLIGHT requests outstanding or has not read
+        // the replies it already got
+        if (!conn->armed && conn->inflight < MAX_INFLIGHT && !conn->writing) armConnection(conn, EPOLL_CTL_MOD);
+        return 0;
+    }
+    if (conn->inflight > 0 || conn->writing) return 0;
+    if (conn->armed) {
+        // An epoll event may already be on its way to the loop; let the loop free it
+        shutdown(conn->fd, SHUT_RDWR);
+        return 0;
     }
+    return 1;
+}
 
-    // Cleanup previous files if exist
-    unlink(tarFilePath);
-    unlink(fileListPath);
+// Worker thread: runs queued requests, which may block on the filesystem but never on the socket
+static void *workerMain(void *arg) {
+    (void)arg;
+    Arena arena = { NULL, NULL };
+    while (1) {
+        pthread_mutex_lock(&jobQueue.lock);
+        while (jobQueue.head == NULL) pthread_cond_wait(&jobQueue.ready, &jobQueue.lock);
+        Request *req = jobQueue.head;
+        jobQueue.head = req->next;
+        if (jobQueue.head == NULL) jobQueue.tail = NULL;
+        atomic_fetch_sub(&queuedRequests, 1);
+        pthread_mutex_unlock(&jobQueue.lock);
 
-    // Parse the given date
-    struct tm given_date;
-    memset(&given_date, 0, sizeof(struct tm));
-    strptime(date, "%Y-%m-%d", &given_date);
-    time_t given_time = mktime(&given_date);
-
-    // Execute the find command and write the file names to fileListPath
-    char findCommand[BUFFER_SIZE * 3];
-    snprintf(findCommand, sizeof(findCommand), "find ~ -type f -printf '%%T@ %%p\\n'");
-    fp = popen(findCommand, "r");
-    if (fp == NULL) {
-        write(client_sock_fd, "Failed to execute find command.\n", 31);
+        Conn *conn = req->conn;
+        req->arena = &arena;
+        req->stat = statCommandOf(req->command);
+        atomic_fetch_add(&activeRequests, 1);
+        uint64_t start = statsClock();
+        crequest(req);
+        statRequestDone(req, start);
+        atomic_fetch_sub(&activeRequests, 1);
+        arenaReset(&arena);
+        free(req);
+
+        pthread_mutex_lock(&conn->lock);
+        conn->inflight--;
+        int done = pumpConnection(conn);
+        pthread_mutex_unlock(&conn->lock);
+        if (done) freeConnection(conn);
+    }
+    return NULL;
+}
+
+// Starts serving an accepted client socket on this process
+static void adoptConnection(int fd) {
+    Conn *conn = calloc(1, sizeof(Conn));
+    if (!conn) {
+        close(fd);
         return;
     }
+    atomic_fetch_add(&openConnections, 1);
+    conn->fd = fd;
+    conn->spillFd = -1;
+    conn->state = CONN_READING;
+    // Pending output no longer times out in a worker; the kernel drops a client that stops reading
+    unsigned int timeout = SEND_TIMEOUT_MS;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_mutex_init(&conn->writeLock, NULL);
+    armConnection(conn, EPOLL_CTL_ADD);
+    if (!conn->armed) freeConnection(conn);
+}
+
+// Abstract-namespace address of the control socket of the mirror serving port
+static socklen_t controlAddress(int port, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "w24-mirror-%d", port);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+// Sends one control message, optionally passing a descriptor along with it
+static int sendControl(int fd, uint32_t type, int passFd) {
+    ControlMsg msg = { .type = type };
+    if (type == CTL_PONG) {
+        msg.active = atomic_load(&activeRequests);
+        msg.queued = atomic_load(&queuedRequests);
+        msg.conns = atomic_load(&openConnections);
+    }
+    struct iovec iov = { &msg, sizeof(msg) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (passFd >= 0) {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &passFd, sizeof(int));
+    }
+    return sendmsg(fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(msg) ? 0 : -1;
+}
+
+// Takes a mirror out of rotation until a later health tick reconnects it
+static void mirrorDown(Mirror *m, const char *why) {
+    close(m->fd);  // Closing also drops the fd from the epoll set
+    m->fd = -1;
+    if (m->healthy) {
+        printf("Mirror on port %d is down (%s)\n", m->port, why);
+        fflush(stdout);
+    }
+    m->healthy = 0;
+}
 
-    // Open the file list to write
-    FILE *fileList = fopen(fileListPath, "w");
-    if (fileList == NULL) {
-        pclose(fp);
-        write(client_sock_fd, "Failed to create file list.\n", 28);
+// Opens the control link to a mirror and pings it; the first pong puts it in rotation.
+// A hung mirror still completes the connect from its listen backlog, so that alone proves nothing.
+static void mirrorConnect(Mirror *m) {
+    struct sockaddr_un addr;
+    socklen_t len = controlAddress(m->port, &addr);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = m };
+    if (connect(fd, (struct sockaddr *) &addr, len) < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
         return;
     }
+    m->fd = fd;
+    m->missed = 0;
+    if (sendControl(fd, CTL_PING, -1) == 0) m->missed++;
+}
 
-    // Read the output from find, parse it, and write to fileList
-    char line[BUFFER_SIZE];
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        double epoch_time;
-        char file_path[BUFFER_SIZE];
-        if (sscanf(line, "%lf %s", &epoch_time, file_path) == 2) {
-            if (epoch_time >= (double)given_time) {
-                fprintf(fileList, "%s\n", file_path);
+// Periodic health check: pings live mirrors, drops silent ones and retries dead ones
+static void healthTick(void) {
+    uint64_t expirations;
+    if (read(healthTimerFd, &expirations, sizeof(expirations)) < 0) return;
+    localAccepted = 0;
+    for (int i = 0; i < mirrorCount; i++) {
+        Mirror *m = &mirrors[i];
+        if (m->fd < 0) {
+            mirrorConnect(m);
+        } else if (m->missed >= HEALTH_MAX_MISSED) {
+            mirrorDown(m, "not answering pings");
+        } else if (sendControl(m->fd, CTL_PING, -1) < 0) {
+            mirrorDown(m, strerror(errno));
+        } else {
+            m->missed++;
+        }
+    }
+}
+
+// Reads load reports from a mirror; a closed link means the mirror is gone
+static void mirrorReadable(Mirror *m) {
+    ControlMsg msg;
+    while (1) {
+        ssize_t n = recv(m->fd, &msg, sizeof(msg), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        if (n <= 0) {
+            mirrorDown(m, n == 0 ? "control link closed" : strerror(errno));
+            return;
+        }
+        if (n == sizeof(msg) && msg.type == CTL_PONG) {
+            if (!m->healthy) {
+                m->healthy = 1;
+                printf("Mirror on port %d is up\n", m->port);
+                fflush(stdout);
             }
+            m->missed = 0;
+            m->load = msg.active + msg.queued;
+            m->handedOff = 0;
         }
     }
-    fclose(fileList);
-    pclose(fp);
+}
 
-    // Prepare the tar command
-    char tarCommand[BUFFER_SIZE * 3];
-    snprintf(tarCommand, sizeof(tarCommand),
-             "tar --transform 's#.*/##' -czf %s -T %s",
-             tarFilePath, fileListPath);
+// Picks the least loaded backend for a new connection, this process included, and
+// passes the socket to a mirror if one wins. Returns 1 if the socket was handed off.
+static int dispatchConnection(int fd) {
+    // Connections placed since the last report count as load so bursts spread out
+    int best = mirrorCount;  // mirrorCount stands for the primary itself
+    int bestLoad = INT_MAX;
+    for (int k = 0; k <= mirrorCount; k++) {
+        int i = (dispatchCursor + k) % (mirrorCount + 1);
+        int load;
+        if (i == mirrorCount) {
+            load = atomic_load(&activeRequests) + atomic_load(&queuedRequests) + localAccepted;
+        } else if (mirrors[i].healthy) {
+            load = mirrors[i].load + mirrors[i].handedOff;
+        } else {
+            continue;
+        }
+        if (load < bestLoad) {
+            best = i;
+            bestLoad = load;
+        }
+    }
+    dispatchCursor = (dispatchCursor + 1) % (mirrorCount + 1);
 
-    // Execute the tar command
-    status = system(tarCommand);
-    if (status != 0) {
-        write(client_sock_fd, "Failed to pack files into tar.\n", 30);
-        return;
+    if (best < mirrorCount) {
+        Mirror *m = &mirrors[best];
+        if (sendControl(m->fd, CTL_HANDOFF, fd) == 0) {
+            m->handedOff++;
+            close(fd);
+            return 1;
+        }
+        mirrorDown(m, strerror(errno));
     }
+    localAccepted++;
+    return 0;
+}
 
-    // Notify the client of successful tar file creation
-    char notification[BUFFER_SIZE];
-    snprintf(notification, sizeof(notification), "Files packed into %s\n", tarFilePath);
-    write(client_sock_fd, notification, strlen(notification));
+// Accepts every pending connection so bursts never wait behind slow requests
+static void acceptConnections(int sockfd) {
+    while (1) {
+        int fd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("ERROR on accept");
+            return;
+        }
+        if (mirrorCount > 0 && dispatchConnection(fd)) continue;
+        adoptConnection(fd);
+    }
 }
 
+// Mirror mode: accepts control links from primaries
+static void acceptControlPeers(void) {
+    while (1) {
+        int fd = accept4(controlFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("ERROR on accept");
+            return;
+        }
+        int slot = 0;
+        while (slot < MAX_CONTROL_PEERS && controlPeers[slot] >= 0) slot++;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &controlPeers[slot] };
+        if (slot == MAX_CONTROL_PEERS || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            continue;
+        }
+        controlPeers[slot] = fd;
+    }
+}
 
-void crequest(int client_sock_fd) {
-    char buffer[BUFFER_SIZE];
-    while (1) {  // Infinite loop to handle client commands
-        memset(buffer, 0, BUFFER_SIZE); 
-        if (read(client_sock_fd, buffer, BUFFER_SIZE - 1) < 0) error("ERROR reading from socket");
+// Mirror mode: answers pings and adopts client sockets passed by a primary
+static void controlReadable(int *peer) {
+    while (*peer >= 0) {
+        ControlMsg msg;
+        struct iovec iov = { &msg, sizeof(msg) };
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+        ssize_t n = recvmsg(*peer, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        if (n <= 0) {
+            close(*peer);
+            *peer = -1;
+            return;
+        }
 
-        if (strncmp(buffer, "quitc", 5) == 0) {
-            printf("Client has requested to close the connection.\n");
-            break;  // Exit loop and end child process
-        }
-
-        if (strncmp(buffer, "dirlist -a", 10) == 0) {
-        	listDirectoriesAlphabetically(client_sock_fd);
-	} else if (strncmp(buffer, "dirlist -t", 10) == 0) {
-		listDirectoriesByCreationTime(client_sock_fd);
-	} else if (strncmp(buffer, "w24fn ", 6) == 0) { // Check if the command is w24fn
-	    char filename[BUFFER_SIZE];
-            strncpy(filename, buffer + 6, BUFFER_SIZE); // Extract the filename from the command
-            sendFileInfo(client_sock_fd, filename);
-        } else if (strncmp(buffer, "w24ft ", 6) == 0) {
-            char extensions[BUFFER_SIZE];
-            strcpy(extensions, buffer + 6); // Extract the extensions part from the command
-            packFilesByExtension(client_sock_fd, extensions);
-        } else if (strncmp(buffer, "w24fz ", 6) == 0) {
-            long size1, size2;
-            sscanf(buffer + 6, "%ld %ld", &size1, &size2); // Extract size1 and size2
-            if(size1 < size2) {
-                packFilesBySize(client_sock_fd, size1, size2);
-            } else {
-                write(client_sock_fd, "Error: size1 must be less than size2.\n", 38);
-            }
-        } else if (strncmp(buffer, "w24fdb ", 7) == 0) {
-            // Extract the date string from the command
-            char dateStr[BUFFER_SIZE];
-            strncpy(dateStr, buffer + 7, BUFFER_SIZE - 7);
-
-            // Validate the date format (YYYY-MM-DD)
-            struct tm date;
-            if (strptime(dateStr, "%Y-%m-%d", &date) == NULL) {
-                write(client_sock_fd, "Invalid date format.\n", 20);
-            } else {
-                // Call the function to pack files by date
-                packFilesByDate(client_sock_fd, dateStr);
-            }
-        } else if (strncmp(buffer, "w24fda ", 7) == 0) {
-            // Extract the date string from the command
-            char dateStr[BUFFER_SIZE];
-            strncpy(dateStr, buffer + 7, BUFFER_SIZE - 7);
-
-            // Validate the date format (YYYY-MM-DD)
-            struct tm date;
-            if (strptime(dateStr, "%Y-%m-%d", &date) == NULL) {
-                write(client_sock_fd, "Invalid date format.\n", 20);
-            } else {
-                // Call the function to pack files by date
-                packFilesByDateGreat(client_sock_fd, dateStr);
-            }
-        } else {
-            if (write(client_sock_fd, "Unsupported operation\n", 23) < 0) error("ERROR writing to socket");
+        int passed = -1;
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+            memcpy(&passed, CMSG_DATA(cm), sizeof(int));
+
+        if (n == sizeof(msg) && msg.type == CTL_HANDOFF && passed >= 0) {
+            // The socket keeps the O_NONBLOCK the primary accepted it with
+            adoptConnection(passed);
+            continue;
+        }
+        if (passed >= 0) close(passed);
+        if (n == sizeof(msg) && msg.type == CTL_PING) sendControl(*peer, CTL_PONG, -1);
+    }
+}
+
+// Reads whatever a readable connection has sent and dispatches every complete request
+static void readConnection(Conn *conn, uint32_t events) {
+    pthread_mutex_lock(&conn->lock);
+    conn->armed = 0;
+    if (conn->state == CONN_READING) {
+        ssize_t n = read(conn->fd, conn->in + conn->inLen, sizeof(conn->in) - conn->inLen);
+        if (n > 0) {
+            conn->inLen += n;
+        } else if (n == 0 || (errno != EAGAIN && errno != EINTR) || (events & EPOLLERR)) {
+            // Hung up: requests already received still get their replies
+            conn->state = CONN_DRAINING;
         }
     }
-    close(client_sock_fd);  // Close client socket when done
+    int done = pumpConnection(conn);
+    pthread_mutex_unlock(&conn->lock);
+    if (done) freeConnection(conn);
 }
 
-void signalHandler(int signum) {
-    while(waitpid(-1, NULL, WNOHANG) > 0);
+// Sends what a connection left pending once its socket drained, and lets it take requests
+// again when nothing is left
+static void writeConnection(Conn *conn) {
+    pthread_mutex_lock(&conn->writeLock);
+    conn->outArmed = 0;
+    int left = connDrain(conn);
+    if (left < 0) {
+        perror("ERROR writing to socket");
+        shutdown(conn->fd, SHUT_RDWR);
+        connDiscard(conn);
+    } else if (left > 0 && connArmWriter(conn) < 0) {
+        perror("ERROR on epoll_ctl");
+        shutdown(conn->fd, SHUT_RDWR);
+        connDiscard(conn);
+    }
+    pthread_mutex_lock(&conn->lock);
+    int done = 0;
+    if (!conn->pending) {
+        conn->writing = 0;
+        done = pumpConnection(conn);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    pthread_mutex_unlock(&conn->writeLock);
+    if (done) freeConnection(conn);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p port] [-c MiB] [-t sec] [-i] [-l level] [-j n] [-P port] [-f] [-M mirror_port]...\n", prog);
+    fprintf(stderr, "       %s [-p port] [-c MiB] [-t sec] [-i] [-l level] [-j n] [-P port] [-f] -m\n", prog);
+    fprintf(stderr, "  -p port  listen for clients on port (default %d)\n", PORT_NO);
+    fprintf(stderr, "  -M port  primary: balance connections onto the local mirror serving port\n");
+    fprintf(stderr, "  -m       run as a mirror that also accepts connections from a primary\n");
+    fprintf(stderr, "  -c MiB   disk budget for cached archives (default %ld, 0 disables reuse)\n",
+            ARCHIVE_CACHE_BUDGET / (1024 * 1024));
+    fprintf(stderr, "  -t sec   drop cached archives unused for this long (default %d)\n", ARCHIVE_CACHE_TTL);
+    fprintf(stderr, "  -i       match w24ft extensions case-insensitively\n");
+    fprintf(stderr, "  -P port  serve Prometheus metrics on 127.0.0.1:port\n");
+    fprintf(stderr, "  -l level gzip level when a request does not pick one, 0-9 (default 6)\n");
+    fprintf(stderr, "  -j n     compression threads per archive (default one per CPU)\n");
+    fprintf(stderr, "  -f       crawl the tree at startup instead of loading the index snapshot\n");
+    exit(1);
 }
 
-int main(void) {
-    int sockfd, newsockfd;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
+int main(int argc, char *argv[]) {
+    int sockfd;
+    struct sockaddr_in serv_addr;
+    int one = 1;
+    int port = PORT_NO;
+    int metricsPort = 0;
+    int mirrorMode = 0;
+    int freshCrawl = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:M:mc:t:il:j:P:f")) != -1) {
+        if (opt == 'p') {
+            port = atoi(optarg);
+        } else if (opt == 'P') {
+            metricsPort = atoi(optarg);
+        } else if (opt == 'i') {
+            fileIndex.foldCase = 1;
+        } else if (opt == 'l' && atoi(optarg) >= 0 && atoi(optarg) <= 9) {
+            gzipLevel = atoi(optarg);
+        } else if (opt == 'j' && atoi(optarg) > 0) {
+            archiveThreads = atoi(optarg);
+        } else if (opt == 'c') {
+            archiveCache.budget = atol(optarg) * 1024 * 1024;
+        } else if (opt == 't' && atol(optarg) >= 0) {
+            archiveCache.ttl = atol(optarg);
+        } else if (opt == 'M' && mirrorCount < MAX_MIRRORS) {
+            mirrors[mirrorCount].port = atoi(optarg);
+            mirrors[mirrorCount].fd = -1;
+            mirrorCount++;
+        } else if (opt == 'm') {
+            mirrorMode = 1;
+        } else if (opt == 'f') {
+            freshCrawl = 1;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc || port <= 0 || port > 65535 || metricsPort < 0 || metricsPort > 65535 ||
+        (mirrorMode && mirrorCount > 0))
+        usage(argv[0]);
+
+    signal(SIGPIPE, SIG_IGN); // A client vanishing mid-reply must not kill the server
 
-    signal(SIGCHLD, signalHandler); // To avoid zombie processes
+    // Allow as many simultaneous clients as the hard descriptor limit permits
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sockfd < 0) error("ERROR opening socket");
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(PORT_NO);
+    serv_addr.sin_port = htons(port);
 
     if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) error("ERROR on binding");
 
-    listen(sockfd, 5);
-    clilen = sizeof(cli_addr);
+    // Start from the index snapshot, or crawl the tree once; from here on inotify keeps the index
+    // current and a background thread keeps the snapshot current
+    pthread_rwlockattr_t lockAttr;
+    pthread_rwlockattr_init(&lockAttr);
+    pthread_rwlockattr_setkind_np(&lockAttr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&indexLock, &lockAttr);
+    const char *root = getenv("HOME") ? getenv("HOME") : ".";
+    if (freshCrawl || indexSnapshotLoad(root) < 0) indexBuild(root);
+    printf("Indexed %d files in %d directories\n", fileIndex.liveFiles, fileIndex.dirCount);
+    pthread_t snapshotTid;
+    if (pthread_create(&snapshotTid, NULL, indexSnapshotMain, NULL) == 0) pthread_detach(snapshotTid);
+    static char cacheDir[PATH_MAX + 8];  // Read by the reclaim thread for the life of the process
+    snprintf(cacheDir, sizeof(cacheDir), "%s/cache", fileIndex.skipPath);
+    cacheSweep(cacheDir, 1);
+    pthread_t reclaimTid;
+    if (pthread_create(&reclaimTid, NULL, cacheReclaimMain, cacheDir) == 0) pthread_detach(reclaimTid);
 
-    while (1) { // Main loop to accept connections
-        newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-        if (newsockfd < 0) error("ERROR on accept");
+    if (metricsPort > 0) {
+        // Loopback only: the dump is for a local scraper, not for clients
+        static int metricsFd;
+        struct sockaddr_in metricsAddr = { .sin_family = AF_INET, .sin_port = htons(metricsPort),
+                                           .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        pthread_t metricsTid;
+        metricsFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (metricsFd < 0) error("ERROR opening metrics socket");
+        setsockopt(metricsFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(metricsFd, (struct sockaddr *)&metricsAddr, sizeof(metricsAddr)) < 0) error("ERROR binding metrics port");
+        if (listen(metricsFd, 16) < 0) error("ERROR on listen");
+        if (pthread_create(&metricsTid, NULL, metricsMain, &metricsFd) != 0) error("ERROR creating metrics thread");
+        pthread_detach(metricsTid);
+    }
+    fflush(stdout);
 
-        pid_t pid = fork();
-        if (pid < 0) error("ERROR on fork");
+    if (listen(sockfd, SOMAXCONN) < 0) error("ERROR on listen");
 
-        if (pid == 0) { // Child process
-            close(sockfd); // Close listening socket in child
-            crequest(newsockfd); // Handle client request
-            exit(0); // Exit child process when done
-        } else {
-            close(newsockfd); // Close connected socket in parent
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) error("ERROR on epoll_create1");
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &sockfd };
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, sockfd, &ev) < 0) error("ERROR on epoll_ctl");
+    writerEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (writerEpollFd < 0) error("ERROR on epoll_create1");
+    ev.data.ptr = &writerEpollFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, writerEpollFd, &ev) < 0) error("ERROR on epoll_ctl");
+    if (fileIndex.inotifyFd >= 0) {
+        ev.data.ptr = &fileIndex.inotifyFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fileIndex.inotifyFd, &ev) < 0) error("ERROR on epoll_ctl");
+        indexWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (indexWakeFd < 0) error("ERROR on eventfd");
+        ev.data.ptr = &indexWakeFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, indexWakeFd, &ev) < 0) error("ERROR on epoll_ctl");
+    }
+
+    if (mirrorMode) {
+        // Primaries reach this mirror through an abstract socket named after its client port
+        struct sockaddr_un addr;
+        socklen_t len = controlAddress(port, &addr);
+        for (int i = 0; i < MAX_CONTROL_PEERS; i++) controlPeers[i] = -1;
+        controlFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (controlFd < 0) error("ERROR opening control socket");
+        if (bind(controlFd, (struct sockaddr *) &addr, len) < 0) error("ERROR binding control socket");
+        if (listen(controlFd, MAX_CONTROL_PEERS) < 0) error("ERROR on listen");
+        ev.data.ptr = &controlFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, controlFd, &ev) < 0) error("ERROR on epoll_ctl");
+    }
+    if (mirrorCount > 0) {
+        for (int i = 0; i < mirrorCount; i++) mirrorConnect(&mirrors[i]);
+        struct itimerspec period = {
+            { HEALTH_INTERVAL_MS / 1000, (HEALTH_INTERVAL_MS % 1000) * 1000000L },
+            { HEALTH_INTERVAL_MS / 1000, (HEALTH_INTERVAL_MS % 1000) * 1000000L },
+        };
+        healthTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (healthTimerFd < 0 || timerfd_settime(healthTimerFd, 0, &period, NULL) < 0) error("ERROR on timerfd");
+        ev.data.ptr = &healthTimerFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, healthTimerFd, &ev) < 0) error("ERROR on epoll_ctl");
+    }
+
+    // Blocking filesystem work runs on the pool, never on the event loop
+    long workers = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    if (workers < MIN_WORKERS) workers = MIN_WORKERS;
+    for (long i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, workerMain, NULL) != 0) error("ERROR creating worker thread");
+        pthread_detach(tid);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) { // Main loop to accept connections, read commands and keep the index current
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR on epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &sockfd) {
+                acceptConnections(sockfd);
+            } else if (tag == &fileIndex.inotifyFd || tag == &indexWakeFd) {
+                eventfd_t wakes;
+                if (tag == &indexWakeFd) eventfd_read(indexWakeFd, &wakes);
+                pthread_rwlock_wrlock(&indexLock);
+                indexProcessEvents();
+                pthread_rwlock_unlock(&indexLock);
+            } else if (tag == &writerEpollFd) {
+                struct epoll_event ready[64];
+                int count = epoll_wait(writerEpollFd, ready, 64, 0);
+                for (int k = 0; k < count; k++) writeConnection(ready[k].data.ptr);
+            } else if (tag == &healthTimerFd) {
+                healthTick();
+            } else if (tag == &controlFd) {
+                acceptControlPeers();
+            } else if (tag >= (void *) controlPeers && tag < (void *) (controlPeers + MAX_CONTROL_PEERS)) {
+                controlReadable(tag);
+            } else if (tag >= (void *) mirrors && tag < (void *) (mirrors + MAX_MIRRORS)) {
+                if (((Mirror *) tag)->fd >= 0) mirrorReadable(tag);
+            } else {
+                readConnection(tag, events[i].events);
+            }
         }
-        write(newsockfd, "END", 3);
     }
     close(sockfd); // This line is actually never reached
     return 0;
@@ -67,15 +67,11 @@ void listDirectories(int client_sock_fd, int sort_by_time) {
         while ((dir = readdir(d)) != NULL && count < MAX_DIRS) {
             char full_path[BUFFER_SIZE];
             snprintf(full_path, sizeof(full_path), "%s/%s", homeDir, dir->d_name);
-            stat(full_path, &path_stat);
-            if (S_ISDIR(path_stat.st_mode)) {  // Check if it's a directory using stat
+            // One stat both classifies the entry and supplies its time
+            if (stat(full_path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
                 entries[count] = malloc(sizeof(DirEntry));
                 entries[count]->name = strdup(dir->d_name);
-                if (stat(full_path, &path_stat) == 0) {
-                    entries[count]->mod_time = path_stat.st_mtime;
-                } else {
-                    entries[count]->mod_time = 0;
-                }
+                entries[count]->mod_time = path_stat.st_mtime;
                 count++;
             }
         }